@@ -0,0 +1,48 @@
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "Accumulation.hpp"
+#include "float3.h"
+
+// a header of what the sums are of, then the arrays as they are in memory
+bool Accumulation::save(std::string filename) const{
+    std::ofstream file(filename, std::ios::binary);
+    auto put = [&](const void* data, size_t size){
+	file.write((const char*)data, size);
+    };
+    const int32_t settings[5] = {width, height, max_bounces, first_sample, end_sample};
+    put("RTACCUM1", 8);
+    put(&scene_hash, sizeof(scene_hash));
+    put(settings, sizeof(settings));
+    put(sums.data(), sums.size()*sizeof(int64_t));
+    put(counts.data(), counts.size()*sizeof(cl_uint));
+    file.close();
+    return (bool)file;
+}
+
+bool Accumulation::load(std::string filename){
+    std::ifstream file(filename, std::ios::binary);
+    auto get = [&](void* data, size_t size){
+	file.read((char*)data, size);
+    };
+    char magic[8];
+    int32_t settings[5];
+    get(magic, 8);
+    get(&scene_hash, sizeof(scene_hash));
+    get(settings, sizeof(settings));
+    if (!file || std::string(magic, 8) != "RTACCUM1" || settings[0] <= 0 || settings[1] <= 0)
+	return false;
+    width = settings[0];
+    height = settings[1];
+    max_bounces = settings[2];
+    first_sample = settings[3];
+    end_sample = settings[4];
+    const long pixels = (long)width*height;
+    sums.resize(3*pixels);
+    counts.resize(pixels);
+    get(sums.data(), sums.size()*sizeof(int64_t));
+    get(counts.data(), counts.size()*sizeof(cl_uint));
+    return (bool)file;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <cmath>
+
+#include "float3.h"
+
+// sums are kept in fixed point, in units of 2^-24. whole numbers add up
+// exactly in any order, so the merged image is the same however the samples
+// were split between processes
+const double FIXED_POINT_ONE = 16777216.0;
+
+// a sample that isn't finite is left out rather than spoiling the pixel
+inline int64_t to_fixed(float v){
+    return std::isfinite(v) ? std::llround(v*FIXED_POINT_ONE) : 0;
+}
+
+// the unnormalized sums of a range of samples of every pixel, written by
+// bin/main with --accumulate and added up into the image by bin/merge
+struct Accumulation{
+    uint64_t scene_hash;
+    int width;
+    int height;
+    int max_bounces;
+    int first_sample; // the range of sample indices every pixel took
+    int end_sample;
+    std::vector<int64_t> sums;   // RGB of each pixel
+    std::vector<cl_uint> counts; // samples in each pixel
+    bool save(std::string filename) const;
+    bool load(std::string filename);
+};
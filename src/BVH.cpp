@@ -2,6 +2,8 @@
 #include <float.h>
 #include <vector>
 
+#include <cmath>
+
 #include "BVH.hpp"
 #include "GPU_BVHnode.h"
 #include "Triangle.h"
@@ -62,7 +64,7 @@ BVHnode* BVH::recurse(std::vector<BBoxTemp*>& working, int depth = 0){
         }
 
         // if box is too thin in this direction
-        if (abs(stop - start) < 1e-4)
+        if (fabs(stop - start) < 1e-4)
             continue;
 
         // check discrete number of different splits on each axis
@@ -0,0 +1,285 @@
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <vector>
+
+#include "Bloom.hpp"
+#include "float3.h"
+#include "ThreadPool.hpp"
+
+const int FFT_RADIUS = 96; // above this a pass costs less by FFT than tap by tap
+const int ROWS_PER_TASK = 8;
+const int LINE_GROUP = 16; // lines convolved together by FFT, a cache line of columns
+
+typedef std::complex<float> Complex;
+
+// the 2D kernel is the product of two of these
+std::vector<float> bloom_taps(int radius, int width){
+    std::vector<float> taps(2*radius + 1);
+    float stddev = 5.0/512*width;
+    float denom = 2*stddev*stddev;
+    for (int k = -radius; k <= radius; ++k)
+	taps[k + radius] = exp(-k*k/denom)/sqrt(denom*M_PI);
+    return taps;
+}
+
+// one row, out[x] is the sum of taps[k + radius]*in[x + k] over the taps
+// that land inside the row
+__attribute__((target_clones("avx2", "default")))
+static void convolve_row(const float* in, float* out, int width, const float* taps, int radius){
+    std::fill(out, out + width, 0.0f);
+    for (int k = -radius; k <= radius; ++k){
+	const float w = taps[k + radius];
+	const float* shifted = in + k;
+	const int x0 = std::max(0, -k);
+	const int x1 = std::min(width, width - k);
+#pragma GCC ivdep
+	for (int x = x0; x < x1; ++x)
+	    out[x] += w*shifted[x];
+    }
+}
+
+// a row of the vertical pass, a weighted sum of whole rows above and below
+// it. centre is the row in the horizontally blurred plane, with the given
+// number of rows of the image above and below it
+__attribute__((target_clones("avx2", "default")))
+static void convolve_column(const float* centre, float* out, int width, int above, int below, const float* taps, int radius){
+    std::fill(out, out + width, 0.0f);
+    for (int k = std::max(-radius, -above); k <= std::min(radius, below); ++k){
+	const float w = taps[k + radius];
+	const float* row = centre + (long)k*width;
+#pragma GCC ivdep
+	for (int x = 0; x < width; ++x)
+	    out[x] += w*row[x];
+    }
+}
+
+// linear convolution of whole lines by FFT, two at a time as the real and
+// imaginary parts of one signal. the taps are symmetric, so their spectrum is
+// real and keeps the two lines apart.
+class LineConvolver{
+private:
+    int n; // a power of two with room for a line and the taps hanging off one end
+    std::vector<Complex> twiddles;
+    std::vector<float> spectrum;
+    void fft(Complex* data, bool inverse) const;
+public:
+    LineConvolver(int length, const std::vector<float>& taps);
+    int size() const {return n;}
+    // LINE_GROUP lines starting at in and out, line_step apart with step
+    // between their values. buffer has room for LINE_GROUP/2*size() values
+    void convolve(const float* in, float* out, int lines, int length, long step, long line_step, Complex* buffer) const;
+};
+
+LineConvolver::LineConvolver(int length, const std::vector<float>& taps){
+    const int radius = taps.size()/2;
+    n = 1;
+    while (n < length + radius)
+	n *= 2;
+    twiddles = std::vector<Complex>(n/2);
+    for (int k = 0; k < n/2; ++k)
+	twiddles[k] = std::polar(1.0f, (float)(-2*M_PI*k/n));
+
+    // centred on zero, with the negative taps wrapped round to the end
+    std::vector<Complex> kernel(n, 0.0f);
+    for (int k = -radius; k <= radius; ++k)
+	kernel[(k + n)%n] = taps[k + radius]/n; // the 1/n the inverse transform leaves out
+    fft(kernel.data(), false);
+    spectrum = std::vector<float>(n);
+    for (int k = 0; k < n; ++k)
+	spectrum[k] = kernel[k].real();
+}
+
+// iterative radix 2, in place. the products are written out because
+// std::complex checks every one for infinities
+void LineConvolver::fft(Complex* data, bool inverse) const{
+    for (int i = 1, j = 0; i < n; ++i){
+	int bit = n >> 1;
+	for (; j & bit; bit >>= 1)
+	    j ^= bit;
+	j ^= bit;
+	if (i < j)
+	    std::swap(data[i], data[j]);
+    }
+    const float sign = inverse ? -1 : 1;
+    for (int len = 2; len <= n; len *= 2){
+	const int stride = n/len;
+	for (int i = 0; i < n; i += len){
+	    for (int k = 0; k < len/2; ++k){
+		float wr = twiddles[k*stride].real();
+		float wi = sign*twiddles[k*stride].imag();
+		Complex u = data[i + k];
+		Complex x = data[i + k + len/2];
+		Complex v(x.real()*wr - x.imag()*wi, x.real()*wi + x.imag()*wr);
+		data[i + k] = u + v;
+		data[i + k + len/2] = u - v;
+	    }
+	}
+    }
+}
+
+void LineConvolver::convolve(const float* in, float* out, int lines, int length, long step, long line_step, Complex* buffer) const{
+    // the lines of a group are read together, so columns are gathered a
+    // cache line at a time rather than one value per line
+    const int pairs = (lines + 1)/2;
+    for (int i = 0; i < length; ++i){
+	const float* p = in + i*step;
+	for (int j = 0; j < pairs; ++j)
+	    buffer[(long)j*n + i] = Complex(p[2*j*line_step], 2*j + 1 < lines ? p[(2*j + 1)*line_step] : 0);
+    }
+    for (int j = 0; j < pairs; ++j){
+	Complex* line = buffer + (long)j*n;
+	std::fill(line + length, line + n, 0.0f);
+	fft(line, false);
+	for (int k = 0; k < n; ++k)
+	    line[k] *= spectrum[k];
+	fft(line, true);
+    }
+    for (int i = 0; i < length; ++i){
+	float* p = out + i*step;
+	for (int j = 0; j < pairs; ++j){
+	    p[2*j*line_step] = buffer[(long)j*n + i].real();
+	    if (2*j + 1 < lines)
+		p[(2*j + 1)*line_step] = buffer[(long)j*n + i].imag();
+	}
+    }
+}
+
+// every row or every column of the three channels, a group of lines per task
+static void fft_pass(std::vector<float>* in, std::vector<float>* out, int width, int height, bool horizontal,
+		     const std::vector<float>& taps, ThreadPool& pool){
+    const int length = horizontal ? width : height;
+    const int lines = horizontal ? height : width;
+    const long step = horizontal ? 1 : width;
+    const long line_step = horizontal ? width : 1;
+    const LineConvolver convolver(length, taps);
+    std::vector<std::vector<Complex>> buffers(pool.size(), std::vector<Complex>((long)LINE_GROUP/2*convolver.size()));
+    const int groups = (lines + LINE_GROUP - 1)/LINE_GROUP;
+    pool.run(3*groups, [&](int task, int thread){
+	const int c = task/groups;
+	const int first = task%groups*LINE_GROUP;
+	convolver.convolve(in[c].data() + first*line_step, out[c].data() + first*line_step, std::min(LINE_GROUP, lines - first),
+			   length, step, line_step, buffers[thread].data());
+    });
+}
+
+void bloom(std::vector<float3>& image, int width, int height, int radius, ThreadPool& pool){
+    if (radius < 0)
+	return;
+    const long pixels = (long)width*height;
+    const std::vector<float> taps = bloom_taps(radius, width);
+    // red, green and blue planes of what is brighter than white
+    std::vector<float> bright[3], blurred[3];
+    for (int c = 0; c < 3; ++c){
+	bright[c] = std::vector<float>(pixels);
+	blurred[c] = std::vector<float>(pixels);
+    }
+    for (long i = 0; i < pixels; ++i){
+	bright[0][i] = std::max(image[i].x - 1, 0.0f);
+	bright[1][i] = std::max(image[i].y - 1, 0.0f);
+	bright[2][i] = std::max(image[i].z - 1, 0.0f);
+    }
+
+    if (radius > FFT_RADIUS){
+	fft_pass(bright, blurred, width, height, true, taps, pool);
+	fft_pass(blurred, bright, width, height, false, taps, pool);
+    }
+    else{
+	const int tasks = (height + ROWS_PER_TASK - 1)/ROWS_PER_TASK;
+	pool.run(tasks, [&](int task, int thread){
+	    for (int y = task*ROWS_PER_TASK; y < std::min(height, (task + 1)*ROWS_PER_TASK); ++y)
+		for (int c = 0; c < 3; ++c)
+		    convolve_row(bright[c].data() + (long)y*width, blurred[c].data() + (long)y*width, width, taps.data(), radius);
+	});
+	pool.run(tasks, [&](int task, int thread){
+	    for (int y = task*ROWS_PER_TASK; y < std::min(height, (task + 1)*ROWS_PER_TASK); ++y)
+		for (int c = 0; c < 3; ++c)
+		    convolve_column(blurred[c].data() + (long)y*width, bright[c].data() + (long)y*width, width, y, height - 1 - y,
+				    taps.data(), radius);
+	});
+    }
+
+    for (long i = 0; i < pixels; ++i)
+	image[i] = (1.0f/20)*float3({bright[0][i], bright[1][i], bright[2][i]}) + image[i];
+}
+
+BloomStream::BloomStream(int width, int height, int radius, ThreadPool& pool) :
+    width(width), height(height), radius(radius), pool(pool), rows_in(0), rows_out(0), blurred_first(0){
+    if (radius < 0)
+	return;
+    taps = bloom_taps(radius, width);
+    if (radius > FFT_RADIUS){
+	convolver.reset(new LineConvolver(width, taps));
+	buffers = std::vector<std::vector<Complex>>(pool.size(), std::vector<Complex>((long)LINE_GROUP/2*convolver->size()));
+    }
+}
+
+BloomStream::~BloomStream(){
+}
+
+void BloomStream::add(const float3* rows, int count, std::vector<float3>& done){
+    if (radius < 0){
+	done.assign(rows, rows + (long)count*width);
+	rows_in += count;
+	rows_out = rows_in;
+	return;
+    }
+    waiting.insert(waiting.end(), rows, rows + (long)count*width);
+
+    // the highlights of the new rows, blurred across and added to the planes
+    const long first_new = (long)(rows_in - blurred_first)*width;
+    std::vector<float> bright[3];
+    for (int c = 0; c < 3; ++c){
+	bright[c] = std::vector<float>((long)count*width);
+	blurred[c].resize(first_new + (long)count*width);
+    }
+    for (long i = 0; i < (long)count*width; ++i){
+	bright[0][i] = std::max(rows[i].x - 1, 0.0f);
+	bright[1][i] = std::max(rows[i].y - 1, 0.0f);
+	bright[2][i] = std::max(rows[i].z - 1, 0.0f);
+    }
+    if (convolver){
+	const int groups = (count + LINE_GROUP - 1)/LINE_GROUP;
+	pool.run(3*groups, [&](int task, int thread){
+	    const int c = task/groups;
+	    const int first = task%groups*LINE_GROUP;
+	    convolver->convolve(bright[c].data() + (long)first*width, blurred[c].data() + first_new + (long)first*width,
+				std::min(LINE_GROUP, count - first), width, 1, width, buffers[thread].data());
+	});
+    }
+    else{
+	pool.run((count + ROWS_PER_TASK - 1)/ROWS_PER_TASK, [&](int task, int thread){
+	    for (int y = task*ROWS_PER_TASK; y < std::min(count, (task + 1)*ROWS_PER_TASK); ++y)
+		for (int c = 0; c < 3; ++c)
+		    convolve_row(bright[c].data() + (long)y*width, blurred[c].data() + first_new + (long)y*width, width,
+				 taps.data(), radius);
+	});
+    }
+    rows_in += count;
+
+    // the rows that now have everything within radius below them
+    const int ready = rows_in == height ? height : std::max(rows_out, rows_in - radius);
+    const int finished = ready - rows_out;
+    done.resize((long)finished*width);
+    pool.run((finished + ROWS_PER_TASK - 1)/ROWS_PER_TASK, [&](int task, int thread){
+	std::vector<float> column[3];
+	for (int c = 0; c < 3; ++c)
+	    column[c] = std::vector<float>(width);
+	for (int j = task*ROWS_PER_TASK; j < std::min(finished, (task + 1)*ROWS_PER_TASK); ++j){
+	    const int y = rows_out + j;
+	    for (int c = 0; c < 3; ++c)
+		convolve_column(blurred[c].data() + (long)(y - blurred_first)*width, column[c].data(), width, y, height - 1 - y,
+				taps.data(), radius);
+	    for (int x = 0; x < width; ++x)
+		done[(long)j*width + x] = (1.0f/20)*float3({column[0][x], column[1][x], column[2][x]}) + waiting[(long)j*width + x];
+	}
+    });
+
+    // the next row to finish needs the blurred rows from radius above it
+    waiting.erase(waiting.begin(), waiting.begin() + (long)finished*width);
+    rows_out = ready;
+    const int keep = std::max(blurred_first, ready - radius);
+    for (int c = 0; c < 3; ++c)
+	blurred[c].erase(blurred[c].begin(), blurred[c].begin() + (long)(keep - blurred_first)*width);
+    blurred_first = keep;
+}
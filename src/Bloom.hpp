@@ -0,0 +1,47 @@
+#pragma once
+
+#include <complex>
+#include <memory>
+#include <vector>
+
+#include "float3.h"
+#include "ThreadPool.hpp"
+
+// glow around everything brighter than white. what is above 1 is blurred by
+// a gaussian with a standard deviation of 5/512 of the width, cut off at
+// radius pixels, and a twentieth of it is added back. the gaussian is done
+// as a horizontal then a vertical pass, directly for small radii and by FFT
+// for large ones.
+void bloom(std::vector<float3>& image, int width, int height, int radius, ThreadPool& pool);
+
+// the 1D gaussian both passes use, from -radius to radius
+std::vector<float> bloom_taps(int radius, int width);
+
+class LineConvolver;
+
+// bloom for an image that arrives a band of rows at a time from the top, for
+// output that is streamed to a file. a row is finished once the rows within
+// radius below it are in, so only the rows still waiting and the blurred
+// highlights within radius of them are kept. the same as bloom() up to the
+// FFT radius, above it the vertical pass is still done tap by tap
+class BloomStream{
+private:
+    const int width;
+    const int height;
+    const int radius;
+    std::vector<float> taps;
+    ThreadPool& pool;
+    std::unique_ptr<LineConvolver> convolver; // for the rows above the FFT radius
+    std::vector<std::vector<std::complex<float>>> buffers;
+    std::vector<float3> waiting;   // rows from rows_out, without bloom
+    std::vector<float> blurred[3]; // highlights of rows from blurred_first, blurred across
+    int rows_in;
+    int rows_out;
+    int blurred_first;
+public:
+    BloomStream(int width, int height, int radius, ThreadPool& pool);
+    ~BloomStream();
+    // takes the next count rows and replaces done with the rows this
+    // finishes, with bloom added. every row is done once the last is in
+    void add(const float3* rows, int count, std::vector<float3>& done);
+};
@@ -0,0 +1,641 @@
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <CL/cl.hpp>
+
+#include "Bloom.hpp"
+#include "Camera.h"
+#include "CLRenderer.hpp"
+#include "Environment.hpp"
+#include "EnvSample.h"
+#include "error.hpp"
+#include "Features.h"
+#include "float3.h"
+#include "ImageFile.hpp"
+#include "KernelSource.hpp"
+#include "Material.h"
+#include "RenderOptions.h"
+#include "Scene.hpp"
+#include "Triangle.h"
+
+#ifdef EMBED_KERNEL
+#include "render_kernel_source.h"
+#endif
+
+void CLRenderer::get_platform(){
+    std::vector<cl::Platform> all_platforms;
+    cl::Platform::get(&all_platforms);
+    if (all_platforms.size() == 0)
+        print_error("No platform found. Check OpenCL installation.");
+    platform = all_platforms[0];
+
+    std::clog << "  Using platform: " << platform.getInfo<CL_PLATFORM_NAME>() << std::endl;
+}
+
+void CLRenderer::get_device(){
+    std::vector<cl::Device> all_devices;
+    platform.getDevices(CL_DEVICE_TYPE_GPU, &all_devices);
+    if (all_devices.size() == 0){
+	platform.getDevices(CL_DEVICE_TYPE_ALL, &all_devices);
+	if (all_devices.size() == 0)
+	    print_error("No devices found. Check OpenCL installation.");
+	else
+	    print_warning("Using non-GPU device. GPU recommended.");
+    }
+    device = all_devices[0];
+    unified_memory = device.getInfo<CL_DEVICE_HOST_UNIFIED_MEMORY>();
+
+    std::clog << "  Using device: " << device.getInfo<CL_DEVICE_NAME>() << std::endl;
+    if (unified_memory)
+	std::clog << "  Device shares host memory, using zero-copy buffers." << std::endl;
+}
+
+std::string CLRenderer::cache_filename(std::string flags){
+    unsigned long long key = hash_string(platform.getInfo<CL_PLATFORM_NAME>());
+    key = hash_string(device.getInfo<CL_DEVICE_NAME>(), key);
+    key = hash_string(device.getInfo<CL_DEVICE_VERSION>(), key);
+    key = hash_string(device.getInfo<CL_DRIVER_VERSION>(), key);
+    key = hash_string(kernel_source, key);
+    key = hash_string(flags, key);
+    std::ostringstream name;
+    name << options.cache_dir << "/" << std::hex << std::setw(16) << std::setfill('0') << key << ".bin";
+    return name.str();
+}
+
+bool CLRenderer::load_cached_binary(std::string filename, std::string flags, cl::Program& program){
+    std::ifstream file(filename, std::ios::binary);
+    if (!file)
+	return false;
+    std::string binary((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    cl::Program::Binaries binaries;
+    binaries.push_back({binary.data(), binary.size()});
+    std::vector<cl_int> status;
+    cl_int result;
+    program = cl::Program(context, {device}, binaries, &status, &result);
+    if (result != CL_SUCCESS || program.build({device}, flags.c_str()) != CL_SUCCESS){
+	print_warning("Ignoring unusable cached program " + filename);
+	return false;
+    }
+    return true;
+}
+
+void CLRenderer::save_cached_binary(std::string filename, cl::Program& program){
+    size_t size;
+    clGetProgramInfo(program(), CL_PROGRAM_BINARY_SIZES, sizeof(size_t), &size, NULL);
+    std::vector<unsigned char> binary(size);
+    unsigned char* data = binary.data();
+    clGetProgramInfo(program(), CL_PROGRAM_BINARIES, sizeof(unsigned char*), &data, NULL);
+
+    // write somewhere else first so another process never reads half a binary
+    mkdir(options.cache_dir.c_str(), 0755);
+    std::string temp = filename + "." + std::to_string(getpid());
+    std::ofstream file(temp, std::ios::binary);
+    file.write((const char*)binary.data(), binary.size());
+    file.close();
+    if (!file || rename(temp.c_str(), filename.c_str()) != 0){
+	print_warning("Unable to cache program in " + filename);
+	remove(temp.c_str());
+    }
+}
+
+cl::Program CLRenderer::build_program(std::string defines){
+    std::string flags = defines;
+    cl::Program program;
+    std::string cached;
+    if (!options.cache_dir.empty()){
+	cached = cache_filename(flags);
+	if (load_cached_binary(cached, flags, program)){
+	    std::clog << "  Loaded cached program " << cached << std::endl;
+	    return program;
+	}
+    }
+
+    cl::Program::Sources sources;
+    sources.push_back({kernel_source.c_str(), kernel_source.length()});
+    program = cl::Program(context, sources);
+    int result = program.build({device}, flags.c_str());
+    if (result != CL_SUCCESS){
+        if (result == CL_OUT_OF_HOST_MEMORY)
+            std::cout << "out pf host memory"<<std::endl;
+	print_error(program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device));
+    }
+    else
+	std::clog << "  Sucessfully built program." << std::endl;
+
+    if (!cached.empty())
+	save_cached_binary(cached, program);
+    return program;
+}
+
+// describe what the scene uses so the kernel can leave out everything else
+std::string CLRenderer::scene_defines(const Scene& scene){
+    SceneFeatures features = scene.features();
+
+    std::ostringstream defines;
+    defines << " -D HAS_LAMBERTIAN=" << features.lambertian
+	    << " -D HAS_COOK_TORRANCE=" << features.cook_torrance
+	    << " -D HAS_REFRACTION=" << features.refraction
+	    << " -D HAS_LENS=" << features.lens
+	    << " -D HAS_ENVMAP=" << features.environment
+	    << " -D MAX_BOUNCES=" << options.max_bounces
+	    << " -D HAS_FEATURES=" << keep_features
+	    << " -D HAS_AOVS=" << keep_aovs;
+    return defines.str();
+}
+
+void CLRenderer::build(const Scene& scene){
+    std::string defines = scene_defines(scene);
+    if (programs.count(defines) == 0){
+	std::clog << "  Building kernel with" << defines << std::endl;
+	programs[defines] = build_program(defines);
+    }
+    program = programs[defines];
+}
+
+CLRenderer::CLRenderer(std::string kernel_filename, const RenderOptions& opts) : Renderer(opts), device_post(false){
+    std::clog << "Initializing OpenCL..." << std::endl;
+#ifdef EMBED_KERNEL
+    kernel_source = embedded_kernel_source;
+#else
+    kernel_source = expand_includes(kernel_filename);
+#endif
+    get_platform();
+    get_device();
+    context = cl::Context({device});
+    queue = cl::CommandQueue(context, device);
+    copy_queue = cl::CommandQueue(context, device);
+}
+
+// a render launch that has been enqueued but not waited on
+struct Launch{
+    cl::Event done;      // finished, including the mask update if there is one
+    long batch;
+    long active;         // pixels it traces, corrected once the launch before it finishes
+    cl_int active_after; // read back from the mask update
+};
+
+void CLRenderer::render_tile(TileBuffers& bufs, long tile_budget, double seconds, double& paths_per_second, long tile_paths, long active_pixels,
+			     cl_uint active_samples){
+    const Tile& tile = bufs.tile;
+    const long pixels = (long)tile.width*tile.height;
+    const cl_uint max_samples = sample_cap();
+    const double launch_seconds = 0.5; // how long each launch should take in a time limited render
+    const cl_int zero = 0;
+
+    cl::make_kernel<cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer,
+		    cl::Buffer, cl::Buffer, cl_int2, RayGen, int, cl_int4, cl_int2> render_kernel(render_k);
+    cl::make_kernel<cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, float, cl_uint> mask_kernel(mask_k);
+    // work groups are 8x8 so edge tiles get rounded up and the kernel skips the extra work-items
+    cl::EnqueueArgs eargs(queue, cl::NullRange, cl::NDRange((tile.width+7)/8*8, (tile.height+7)/8*8), cl::NDRange(8,8));
+    cl::EnqueueArgs mask_eargs(queue, cl::NullRange, cl::NDRange(pixels), cl::NullRange);
+    cl_int4 tile_rect = {{tile.x, tile.y, tile.width, tile.height}};
+    cl_int2 image_size = {{width, height}};
+
+    // two launches are kept in flight so the device has the next one queued
+    // while the host waits on, accounts for and reports the last
+    std::deque<Launch> in_flight;
+    long queued_paths = 0; // enqueued but not finished, an estimate while the mask is shrinking
+
+    std::chrono::time_point<std::chrono::system_clock> start = std::chrono::system_clock::now();
+    std::chrono::time_point<std::chrono::system_clock> last_finish = start;
+    bool out_of_time = false;
+    while(true){
+	long batch = 0;
+	// a time limited render has to see the pilot batch finish before sizing the next
+	bool measured = options.time_limit <= 0 || paths_per_second > 0 || in_flight.empty();
+	// a checkpoint holds off new launches until the ones in flight are accounted for
+	bool checkpoint = checkpoint_due();
+	if (checkpoint && in_flight.empty()){
+	    checkpoint_tile(bufs);
+	    if (stopped)
+		break;
+	    checkpoint = false;
+	}
+	if (!checkpoint && !out_of_time && measured && active_pixels > 0 && tile_paths + queued_paths < tile_budget){
+	    if (options.time_limit > 0){
+		std::chrono::duration<double> elapsed = std::chrono::system_clock::now() - start;
+		if (paths_per_second == 0)
+		    batch = 1; // pilot batch to measure the device
+		else{
+		    double remaining = seconds - elapsed.count() - queued_paths/paths_per_second;
+		    batch = paths_per_second*std::min(launch_seconds, remaining)/active_pixels;
+		}
+		out_of_time = batch < 1;
+	    }
+	    else{
+		// keep the work per launch about the same as the mask shrinks
+		batch = 32*pixels/active_pixels;
+	    }
+	    // rounded up without overflowing an unlimited budget, and stopping
+	    // where the next snapshot is due
+	    batch = std::min(batch, (tile_budget - tile_paths - queued_paths - 1)/active_pixels + 1);
+	    batch = std::min(batch, (snapshot_paths() - paths_done - queued_paths - 1)/active_pixels + 1);
+	    // no pixel goes over its cap, however few are left to share the budget
+	    if (active_samples < max_samples)
+		batch = std::min(batch, (long)(max_samples - active_samples));
+	    batch = std::min(batch, 1024L);
+	}
+
+	if (batch > 0){
+	    in_flight.push_back(Launch());
+	    Launch& launch = in_flight.back();
+	    launch.batch = batch;
+	    launch.active = active_pixels;
+	    launch.active_after = active_pixels;
+	    launch.done = render_kernel(eargs, bufs.out, bufs.sq, bufs.counts, bufs.active, bufs.features, bufs.aovs, bvh_buf, triangle_buf, material_buf,
+					env_buf, env_table_buf, env_size, camera, (int)batch, tile_rect, image_size);
+	    // the pilot batch leaves the mask alone, one sample says nothing of the noise
+	    if (options.target_error > 0 && (options.time_limit <= 0 || paths_per_second > 0)){
+		queue.enqueueWriteBuffer(active_count_buf, CL_FALSE, 0, sizeof(cl_int), &zero);
+		mask_kernel(mask_eargs, bufs.out, bufs.sq, bufs.counts, bufs.active, active_count_buf, options.target_error, max_samples);
+		queue.enqueueReadBuffer(active_count_buf, CL_FALSE, 0, sizeof(cl_int), &launch.active_after, NULL, &launch.done);
+	    }
+	    queue.flush();
+	    queued_paths += batch*active_pixels;
+	    active_samples += batch; // the queue is in order, so enqueued is as good as taken
+	    // the queue is in order, so the read sees the image as this launch leaves it
+	    std::string label = due_snapshot(paths_done + queued_paths);
+	    if (!label.empty()){
+		if (snapshot_pending){
+		    snapshot_done.wait();
+		    finish_snapshot();
+		}
+		take_snapshot(bufs, label);
+	    }
+	    if (in_flight.size() < 2)
+		continue;
+	}
+	if (options.preview_file.size() && !snapshot_pending)
+	    take_snapshot(bufs, "");
+	if (in_flight.empty())
+	    break;
+
+	Launch& launch = in_flight.front();
+	launch.done.wait();
+	std::chrono::time_point<std::chrono::system_clock> now = std::chrono::system_clock::now();
+	if (paths_done == 0)
+	    first_sample = now;
+	long paths = launch.batch*launch.active;
+	queued_paths -= paths;
+	tile_paths += paths;
+	paths_done += paths;
+	// the device was busy from when the last launch finished or this one was enqueued
+	std::chrono::duration<double> busy = now - last_finish;
+	paths_per_second = paths/std::max(busy.count(), 1e-6);
+	last_finish = now;
+	if (options.target_error > 0){
+	    active_pixels = launch.active_after;
+	    if (in_flight.size() > 1){
+		Launch& next = in_flight[1];
+		queued_paths += next.batch*(active_pixels - next.active);
+		next.active = active_pixels;
+	    }
+	}
+	in_flight.pop_front();
+
+	if (snapshot_pending && snapshot_done.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>() == CL_COMPLETE)
+	    finish_snapshot();
+	print_progress();
+    }
+    if (snapshot_pending){
+	snapshot_done.wait();
+	finish_snapshot();
+    }
+    converged += pixels - active_pixels;
+}
+
+// the whole image is the tile, read back once the queue is idle
+void CLRenderer::checkpoint_tile(TileBuffers& bufs){
+    const long pixels = (long)width*height;
+    std::vector<float3> sums(pixels);
+    std::vector<float> sq(pixels);
+    std::vector<cl_uint> sample_counts(pixels);
+    std::vector<cl_uchar> active(pixels);
+    std::vector<Features> feature_sums(keep_features ? pixels : 0);
+    std::vector<AOVs> aov_sums(keep_aovs ? pixels : 0);
+    queue.enqueueReadBuffer(bufs.out, CL_FALSE, 0, pixels*sizeof(float3), sums.data());
+    queue.enqueueReadBuffer(bufs.sq, CL_FALSE, 0, pixels*sizeof(float), sq.data());
+    queue.enqueueReadBuffer(bufs.counts, CL_FALSE, 0, pixels*sizeof(cl_uint), sample_counts.data());
+    queue.enqueueReadBuffer(bufs.active, CL_FALSE, 0, pixels*sizeof(cl_uchar), active.data());
+    if (keep_features)
+	queue.enqueueReadBuffer(bufs.features, CL_FALSE, 0, pixels*sizeof(Features), feature_sums.data());
+    if (keep_aovs)
+	queue.enqueueReadBuffer(bufs.aovs, CL_FALSE, 0, pixels*sizeof(AOVs), aov_sums.data());
+    queue.finish();
+    save_checkpoint(sums.data(), sq.data(), sample_counts.data(), active.data(), feature_sums.data(), aov_sums.data());
+}
+
+// fills the tile buffers from the checkpoint instead of zeros
+bool CLRenderer::resume_tile(TileBuffers& bufs, long& active_pixels, cl_uint& active_samples){
+    const long pixels = (long)width*height;
+    std::vector<float3> sums(pixels);
+    std::vector<float> sq(pixels);
+    std::vector<cl_uint> sample_counts(pixels);
+    std::vector<cl_uchar> active(pixels);
+    std::vector<Features> feature_sums(keep_features ? pixels : 0);
+    std::vector<AOVs> aov_sums(keep_aovs ? pixels : 0);
+    if (!load_checkpoint(sums.data(), sq.data(), sample_counts.data(), active.data(), feature_sums.data(), aov_sums.data()))
+	return false;
+    queue.enqueueWriteBuffer(bufs.out, CL_FALSE, 0, pixels*sizeof(float3), sums.data());
+    queue.enqueueWriteBuffer(bufs.sq, CL_FALSE, 0, pixels*sizeof(float), sq.data());
+    queue.enqueueWriteBuffer(bufs.counts, CL_FALSE, 0, pixels*sizeof(cl_uint), sample_counts.data());
+    queue.enqueueWriteBuffer(bufs.active, CL_FALSE, 0, pixels*sizeof(cl_uchar), active.data());
+    if (keep_features)
+	queue.enqueueWriteBuffer(bufs.features, CL_FALSE, 0, pixels*sizeof(Features), feature_sums.data());
+    if (keep_aovs)
+	queue.enqueueWriteBuffer(bufs.aovs, CL_FALSE, 0, pixels*sizeof(AOVs), aov_sums.data());
+    queue.finish();
+    active_pixels = std::count(active.begin(), active.end(), 1);
+    active_samples = lowest_active_count(sample_counts.data(), active.data(), pixels);
+    return true;
+}
+
+// read the tile being rendered into the snapshot buffers without waiting.
+// previews wait for the preview interval, snapshots are taken when they are due
+void CLRenderer::take_snapshot(TileBuffers& bufs, std::string label){
+    std::chrono::duration<double> since = std::chrono::system_clock::now() - last_snapshot;
+    if (label.empty() && since.count() < options.preview_interval)
+	return;
+    snapshot_label = label;
+    long pixels = (long)bufs.tile.width*bufs.tile.height;
+    snapshot_tile = bufs.tile;
+    queue.enqueueReadBuffer(bufs.out, CL_FALSE, 0, pixels*sizeof(float3), snapshot_out.data());
+    queue.enqueueReadBuffer(bufs.counts, CL_FALSE, 0, pixels*sizeof(cl_uint), snapshot_counts.data(), NULL, &snapshot_done);
+    snapshot_pending = true;
+}
+
+void CLRenderer::finish_snapshot(){
+    snapshot_pending = false;
+    if (!snapshot_label.empty()){
+	save_snapshot(snapshot_out.data(), snapshot_counts.data(), snapshot_label);
+	return;
+    }
+    copy_tile(snapshot_tile, snapshot_out.data(), snapshot_counts.data());
+    save_preview();
+    last_snapshot = std::chrono::system_clock::now();
+}
+
+void CLRenderer::finish_tile(TileBuffers& bufs){
+    bufs.done.wait();
+    copy_tile(bufs.tile, bufs.out_host, bufs.counts_host, bufs.features_host, bufs.aovs_host);
+    if (unified_memory){
+	cl::Event unmapped;
+	copy_queue.enqueueUnmapMemObject(bufs.out, bufs.out_host);
+	if (keep_features)
+	    copy_queue.enqueueUnmapMemObject(bufs.features, bufs.features_host);
+	if (keep_aovs)
+	    copy_queue.enqueueUnmapMemObject(bufs.aovs, bufs.aovs_host);
+	copy_queue.enqueueUnmapMemObject(bufs.counts, bufs.counts_host, NULL, &unmapped);
+	unmapped.wait();
+    }
+    bufs.pending = false;
+    // the last tile of a row finishes a band, which goes out while the next tile renders
+    if (options.stream && bufs.tile.x + bufs.tile.width == width)
+	stream_band(bufs.tile.height);
+}
+
+bool CLRenderer::device_image(std::vector<unsigned char>& rgba){
+    if (!device_post)
+	return false;
+    const long pixels = (long)width*height;
+    std::vector<float> taps = bloom_rad >= 0 ? bloom_taps(bloom_rad, width) : std::vector<float>(1, 0.0f);
+    std::vector<float> lut = tonemapper.lut;
+    cl::Buffer taps_buf(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(float)*taps.size(), taps.data());
+    cl::Buffer lut_buf(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(float)*lut.size(), lut.data());
+    cl::Buffer blurred(context, CL_MEM_READ_WRITE, sizeof(float3)*pixels);
+    cl::Buffer rgba_buf(context, CL_MEM_WRITE_ONLY, 4*pixels);
+
+    cl::make_kernel<cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, int, cl_int2> rows_kernel(cl::Kernel(program, "bloom_rows"));
+    cl::make_kernel<cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, int, cl::Buffer, cl::Buffer, cl_int2>
+	finish_kernel(cl::Kernel(program, "finish_image"));
+    cl::EnqueueArgs eargs(queue, cl::NullRange, cl::NDRange((width+7)/8*8, (height+7)/8*8), cl::NDRange(8,8));
+    cl_int2 size = {{width, height}};
+    rows_kernel(eargs, image_buf, counts_buf, blurred, taps_buf, bloom_rad, size);
+    finish_kernel(eargs, image_buf, counts_buf, blurred, taps_buf, bloom_rad, lut_buf, rgba_buf, size);
+
+    rgba = std::vector<unsigned char>(4*pixels);
+    queue.enqueueReadBuffer(rgba_buf, CL_TRUE, 0, 4*pixels, rgba.data());
+    if (!options.sample_map.empty())
+	queue.enqueueReadBuffer(counts_buf, CL_TRUE, 0, sizeof(cl_uint)*pixels, counts.data());
+    std::clog << "  Post processed on the device, read back " << (4*pixels + 524288)/1048576 << " MB" << std::endl;
+    return true;
+}
+
+// on a device that shares host memory the scene is used where it is instead
+// of being copied, otherwise it is uploaded without waiting. either way the
+// in-order queue puts it before the first launch.
+cl::Buffer CLRenderer::scene_buffer(void* data, size_t size){
+    if (unified_memory){
+	shared_bytes += size;
+	return cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, size, data);
+    }
+    cl::Buffer buf(context, CL_MEM_READ_ONLY, size);
+    queue.enqueueWriteBuffer(buf, CL_FALSE, 0, size, data);
+    return buf;
+}
+
+void CLRenderer::render(Scene& scene){
+    build(scene);
+
+    // tiles are handed out in scanline order. without -t the whole image is
+    // one tile, or a band of tiles at a time when the output is streamed.
+    // then the host only holds a row of tiles
+    int tile_size = options.tile_size > 0 ? options.tile_size : options.stream ? std::min(STREAM_ROWS, height) : std::max(width, height);
+    const long held = options.stream ? (long)width*std::min(tile_size, height) : (long)width*height;
+    output = std::vector<float3>(held);
+    counts = std::vector<cl_uint>(held);
+    if (keep_features)
+	features = std::vector<Features>(held);
+    if (keep_aovs)
+	aovs = std::vector<AOVs>(held);
+    std::deque<Tile> tiles;
+    for (int y = 0; y < height; y += tile_size)
+	for (int x = 0; x < width; x += tile_size)
+	    tiles.push_back({x, y, std::min(tile_size, width - x), std::min(tile_size, height - y)});
+    const int num_tiles = tiles.size();
+    const long tile_pixels = (long)std::min(tile_size, width)*std::min(tile_size, height);
+    // a single tile is the whole image, so unless the host needs the floats
+    // it stays on the device and device_image finishes it there
+    const ImageFormat format = image_format(options.output_file);
+    device_post = num_tiles == 1 && !keep_features && !options.stream && format != PFM && format != EXR;
+
+    // two sets of tile buffers so one tile can be read back while the next renders.
+    // with shared memory the results are mapped rather than read into a staging copy
+    cl_mem_flags host_alloc = unified_memory ? CL_MEM_ALLOC_HOST_PTR : 0;
+    TileBuffers sets[2];
+    for (TileBuffers& bufs : sets){
+	bufs.out = cl::Buffer(context, CL_MEM_READ_WRITE | host_alloc, sizeof(float3)*tile_pixels);
+	bufs.sq = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(float)*tile_pixels);
+	bufs.counts = cl::Buffer(context, CL_MEM_READ_WRITE | host_alloc, sizeof(cl_uint)*tile_pixels);
+	bufs.active = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_uchar)*tile_pixels);
+	bufs.features = cl::Buffer(context, CL_MEM_READ_WRITE | host_alloc, sizeof(Features)*(keep_features ? tile_pixels : 1));
+	bufs.aovs = cl::Buffer(context, CL_MEM_READ_WRITE | host_alloc, sizeof(AOVs)*(keep_aovs ? tile_pixels : 1));
+	bufs.features_host = NULL;
+	bufs.aovs_host = NULL;
+	if (!unified_memory){
+	    bufs.out_storage = std::vector<float3>(tile_pixels);
+	    bufs.counts_storage = std::vector<cl_uint>(tile_pixels);
+	    bufs.out_host = bufs.out_storage.data();
+	    bufs.counts_host = bufs.counts_storage.data();
+	    if (keep_features){
+		bufs.features_storage = std::vector<Features>(tile_pixels);
+		bufs.features_host = bufs.features_storage.data();
+	    }
+	    if (keep_aovs){
+		bufs.aovs_storage = std::vector<AOVs>(tile_pixels);
+		bufs.aovs_host = bufs.aovs_storage.data();
+	    }
+	}
+	bufs.pending = false;
+    }
+    active_count_buf = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_int));
+    shared_bytes = 0;
+    bvh_buf = scene_buffer(scene.bvh.GPU_BVH.data(), sizeof(GPU_BVHnode)*scene.bvh.GPU_BVH.size());
+    triangle_buf = scene_buffer(scene.bvh.ordered.data(), sizeof(Triangle)*scene.bvh.ordered.size());
+    material_buf = scene_buffer(scene.materials.data(), sizeof(Material)*scene.materials.size());
+    // the kernel still takes the environment map without one, it just never reads it
+    Environment& env = scene.environment;
+    env_size = {{env.width, env.height}};
+    if (env.empty()){
+	env_buf = cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(float3));
+	env_table_buf = cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(EnvSample));
+    }
+    else{
+	env_buf = scene_buffer(env.pixels.data(), sizeof(float3)*env.pixels.size());
+	env_table_buf = scene_buffer(env.table.data(), sizeof(EnvSample)*env.table.size());
+    }
+    camera = prepare_camera(scene.camera);
+
+
+    render_k = cl::Kernel(program, "render");
+    mask_k = cl::Kernel(program, "update_mask");
+
+    snapshot_out = std::vector<float3>(tile_pixels);
+    snapshot_counts = std::vector<cl_uint>(tile_pixels);
+    snapshot_pending = false;
+
+    std::vector<float3> zeros(tile_pixels, float3({0,0,0}));
+    std::vector<cl_uchar> ones(tile_pixels, 1);
+    std::vector<Features> zero_features(keep_features ? tile_pixels : 0, Features({{0,0,0}, {0,0,0}, 0}));
+    std::vector<AOVs> zero_aovs(keep_aovs ? tile_pixels : 0, AOVs({{0,0,0}, -1}));
+
+    std::clog << "Starting render..." << std::endl;
+    if (unified_memory){
+	shared_bytes += 2*tile_pixels*(sizeof(float3) + sizeof(cl_uint));
+	std::clog << "  Zero-copy saved " << (shared_bytes + 524288)/1048576 << " MB of host copies" << std::endl;
+    }
+    if (num_tiles > 1)
+	std::clog << "  Tiles: " << num_tiles << " of " << tile_size << "x" << tile_size << std::endl;
+    // snapshots need every pixel at the same point, tiles are finished one after another
+    if (take_snapshots && num_tiles > 1){
+	print_warning("Snapshots need the image rendered as a single tile, not taking them");
+	take_snapshots = false;
+    }
+    if (take_checkpoints && num_tiles > 1){
+	print_warning("Checkpoints need the image rendered as a single tile, not taking them");
+	take_checkpoints = false;
+    }
+    start_checkpoints(scene);
+    if (options.stream){
+	std::clog << "  Bands: " << (height + tile_size - 1)/tile_size << " of " << tile_size << " rows" << std::endl;
+	start_stream();
+    }
+
+    // with adaptive sampling samples is a budget for each tile rather than a
+    // count for each pixel. converged pixels drop out of the mask and the
+    // paths they would have traced go to the ones that are still noisy.
+    // with a time limit and no -p the budget is unbounded.
+    const long pixels = (long)width*height;
+    budget = samples > 0 ? pixels*samples : LONG_MAX;
+    paths_done = 0;
+    converged = 0;
+    double paths_per_second = 0;
+    render_start = std::chrono::system_clock::now();
+    last_snapshot = render_start;
+
+    for (int t = 0; !tiles.empty(); ++t){
+	TileBuffers& bufs = sets[t%2];
+	if (bufs.pending)
+	    finish_tile(bufs);
+	bufs.tile = tiles.front();
+	tiles.pop_front();
+	long pixels_in_tile = (long)bufs.tile.width*bufs.tile.height;
+
+	queue.enqueueWriteBuffer(bufs.out, CL_FALSE, 0, pixels_in_tile*sizeof(float3), zeros.data());
+	queue.enqueueWriteBuffer(bufs.sq, CL_FALSE, 0, pixels_in_tile*sizeof(float), zeros.data());
+	queue.enqueueWriteBuffer(bufs.counts, CL_FALSE, 0, pixels_in_tile*sizeof(cl_uint), zeros.data());
+	queue.enqueueWriteBuffer(bufs.active, CL_FALSE, 0, pixels_in_tile*sizeof(cl_uchar), ones.data());
+	if (keep_features)
+	    queue.enqueueWriteBuffer(bufs.features, CL_FALSE, 0, pixels_in_tile*sizeof(Features), zero_features.data());
+	if (keep_aovs)
+	    queue.enqueueWriteBuffer(bufs.aovs, CL_FALSE, 0, pixels_in_tile*sizeof(AOVs), zero_aovs.data());
+
+	// checkpoints are only taken of a single tile
+	long active_pixels = pixels_in_tile;
+	cl_uint active_samples = 0; // every launch adds its batch to every active pixel, so they all have this many
+	const bool resumed = options.resume && take_checkpoints && resume_tile(bufs, active_pixels, active_samples);
+
+	// a time limit is shared out evenly between the tiles that are left
+	double seconds = 0;
+	if (options.time_limit > 0){
+	    std::chrono::duration<double> elapsed = std::chrono::system_clock::now() - render_start;
+	    seconds = (options.time_limit - elapsed.count())/(num_tiles - t);
+	}
+	long tile_budget = samples > 0 ? pixels_in_tile*samples : LONG_MAX;
+	render_tile(bufs, tile_budget, seconds, paths_per_second, resumed ? paths_done : 0, active_pixels, active_samples);
+	if (stopped)
+	    return;
+
+	if (device_post){
+	    image_buf = bufs.out;
+	    counts_buf = bufs.counts;
+	    continue;
+	}
+	// the tile is done, copy it back on the transfer queue while the next one renders
+	if (unified_memory){
+	    bufs.out_host = (float3*)copy_queue.enqueueMapBuffer(bufs.out, CL_FALSE, CL_MAP_READ, 0, pixels_in_tile*sizeof(float3));
+	    if (keep_features)
+		bufs.features_host = (Features*)copy_queue.enqueueMapBuffer(bufs.features, CL_FALSE, CL_MAP_READ, 0,
+									    pixels_in_tile*sizeof(Features));
+	    if (keep_aovs)
+		bufs.aovs_host = (AOVs*)copy_queue.enqueueMapBuffer(bufs.aovs, CL_FALSE, CL_MAP_READ, 0, pixels_in_tile*sizeof(AOVs));
+	    bufs.counts_host = (cl_uint*)copy_queue.enqueueMapBuffer(bufs.counts, CL_FALSE, CL_MAP_READ, 0, pixels_in_tile*sizeof(cl_uint),
+								     NULL, &bufs.done);
+	}
+	else{
+	    copy_queue.enqueueReadBuffer(bufs.out, CL_FALSE, 0, pixels_in_tile*sizeof(float3), bufs.out_host);
+	    if (keep_features)
+		copy_queue.enqueueReadBuffer(bufs.features, CL_FALSE, 0, pixels_in_tile*sizeof(Features), bufs.features_host);
+	    if (keep_aovs)
+		copy_queue.enqueueReadBuffer(bufs.aovs, CL_FALSE, 0, pixels_in_tile*sizeof(AOVs), bufs.aovs_host);
+	    copy_queue.enqueueReadBuffer(bufs.counts, CL_FALSE, 0, pixels_in_tile*sizeof(cl_uint), bufs.counts_host,
+					 NULL, &bufs.done);
+	}
+	copy_queue.flush();
+	bufs.pending = true;
+    }
+    // the older tile first, streamed bands have to be finished in order
+    for (int i = 0; i < 2; ++i)
+	if (sets[(num_tiles + i)%2].pending)
+	    finish_tile(sets[(num_tiles + i)%2]);
+    finish_snapshots();
+
+    std::clog << "Progress:  100% Time remaining: 0h0m0.0s      " << std::endl;
+
+    if (options.target_error > 0)
+	std::clog << "  Converged: " << converged << "/" << pixels << " pixels" << std::endl;
+    if (options.target_error > 0 || options.time_limit > 0)
+	std::clog << "  Samples taken: " << (double)paths_done/pixels << " per pixel" << std::endl;
+}
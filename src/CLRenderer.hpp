@@ -0,0 +1,95 @@
+#pragma once
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <CL/cl.hpp>
+
+#include "Camera.h"
+#include "Features.h"
+#include "float3.h"
+#include "Renderer.hpp"
+#include "RenderOptions.h"
+#include "Scene.hpp"
+
+// device side state for a tile that is being rendered or read back
+struct TileBuffers{
+    Tile tile;
+    cl::Buffer out;
+    cl::Buffer sq;
+    cl::Buffer counts;
+    cl::Buffer active;
+    cl::Buffer features; // a single element unless keep_features
+    cl::Buffer aovs;     // a single element unless keep_aovs
+    float3* out_host; // finished tile, mapped or read into storage
+    cl_uint* counts_host;
+    Features* features_host; // NULL unless keep_features
+    AOVs* aovs_host;         // NULL unless keep_aovs
+    std::vector<float3> out_storage;
+    std::vector<cl_uint> counts_storage;
+    std::vector<Features> features_storage;
+    std::vector<AOVs> aovs_storage;
+    cl::Event done; // read back finished
+    bool pending;
+};
+
+// traces paths with render_kernel.cl on an OpenCL device
+class CLRenderer : public Renderer{
+private:
+    void get_platform();
+    void get_device();
+    cl::Program build_program(std::string defines);
+    std::string cache_filename(std::string flags);
+    bool load_cached_binary(std::string filename, std::string flags, cl::Program& program);
+    void save_cached_binary(std::string filename, cl::Program& program);
+    std::string scene_defines(const Scene& scene);
+    // tile_paths, active_pixels and active_samples are what the tile starts with, from a checkpoint or nothing
+    void render_tile(TileBuffers& bufs, long tile_budget, double seconds, double& paths_per_second, long tile_paths, long active_pixels,
+		     cl_uint active_samples);
+    void checkpoint_tile(TileBuffers& bufs);
+    bool resume_tile(TileBuffers& bufs, long& active_pixels, cl_uint& active_samples);
+    void finish_tile(TileBuffers& bufs);
+    cl::Buffer scene_buffer(void* data, size_t size);
+    void take_snapshot(TileBuffers& bufs, std::string label);
+    void finish_snapshot();
+    bool device_image(std::vector<unsigned char>& rgba);
+    cl::Platform platform;
+    cl::Device device;
+    bool unified_memory;
+    size_t shared_bytes; // host copies avoided by sharing memory with the device
+    cl::Context context;
+    cl::Program program;
+    std::map<std::string, cl::Program> programs; // built programs by their defines
+    cl::CommandQueue queue;
+    cl::CommandQueue copy_queue;
+    cl::Kernel render_k;
+    cl::Kernel mask_k;
+    cl::Buffer bvh_buf;
+    cl::Buffer triangle_buf;
+    cl::Buffer material_buf;
+    cl::Buffer env_buf;
+    cl::Buffer env_table_buf;
+    cl_int2 env_size;
+    cl::Buffer active_count_buf;
+    // the accumulated image and its sample counts, left on the device when
+    // it is rendered as a single tile and nothing needs it on the host
+    bool device_post;
+    cl::Buffer image_buf;
+    cl::Buffer counts_buf;
+    RayGen camera;
+    // a copy of the tile in progress for previews and snapshots, read while
+    // it keeps rendering
+    Tile snapshot_tile;
+    std::string snapshot_label; // empty for a preview
+    std::vector<float3> snapshot_out;
+    std::vector<cl_uint> snapshot_counts;
+    cl::Event snapshot_done;
+    bool snapshot_pending;
+    std::chrono::time_point<std::chrono::system_clock> last_snapshot;
+    std::string kernel_source;
+public:
+    CLRenderer(std::string kernel_filename, const RenderOptions& options);
+    void build(const Scene& scene);
+    void render(Scene& scene);
+};
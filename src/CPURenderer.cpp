@@ -0,0 +1,649 @@
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <cmath>
+
+#include "Accumulation.hpp"
+#include "Camera.h"
+#include "CPURenderer.hpp"
+#include "error.hpp"
+#include "Environment.hpp"
+#include "EnvSample.h"
+#include "Features.h"
+#include "float3.h"
+#include "Material.h"
+#include "Ray.h"
+#include "RenderOptions.h"
+#include "Scene.hpp"
+#include "SIMDIntersect.hpp"
+#include "Triangle.h"
+#include "WideBVH.hpp"
+
+// everything up to trace mirrors render_kernel.cl, with the HAS_* defines
+// turned into checks of the scene's features and the BVH traversal done on
+// a wide BVH with SIMD tests. the random numbers are the same, so both
+// backends converge to the same image.
+
+const float RAND_RANGE = 0x800000U;
+const cl_uint MIN_SAMPLES = 16; // as in the kernel
+
+struct HitData{
+    float t;
+    float3 normal;
+    int mat;
+};
+
+struct RandState{
+    uint32_t key; // hash of the pixel and sample
+    uint32_t dim; // numbers drawn so far
+};
+
+static uint32_t pcg_hash(uint32_t v){
+    uint32_t state = v*747796405U + 2891336453U;
+    uint32_t word = ((state >> ((state >> 28U) + 4U)) ^ state)*277803737U;
+    return (word >> 22U) ^ word;
+}
+
+static RandState rand_init(uint32_t pixel, uint32_t sample){
+    return {pcg_hash(pixel ^ pcg_hash(sample)), 0};
+}
+
+// in [0, 1)
+static float rand_float(RandState& state){
+    uint32_t res = pcg_hash(state.key + pcg_hash(state.dim));
+    state.dim++;
+    return (res&0x7fffff)/RAND_RANGE;
+}
+
+static float cos_theta(float3 w){
+    return w.z;
+}
+
+static float sin_theta(float3 w){
+    return sqrt(std::max(0.0f, 1.0f - w.z*w.z));
+}
+
+static float tan_theta(float3 w){
+    return sin_theta(w)/cos_theta(w);
+}
+
+static float Lambda(float3 w, const Material& mat){
+    float abs_tan_theta = fabs(tan_theta(w));
+    if (abs_tan_theta > 1e20)
+	return 0;
+    float a = 1.0/(mat.alpha*abs_tan_theta);
+    if (a>=1.6)
+	return 0;
+    return (1 - 1.259*a + 0.396*a*a) / (3.535*a + 2.181*a*a);
+}
+
+static float G(float3 in, float3 out, const Material& mat){
+    return 1.0/(1+Lambda(in, mat)+Lambda(out, mat));
+}
+
+static float F(float etaI, float etaT, float cos_thetaI){
+    float sin_thetaI = sqrt(1-cos_thetaI*cos_thetaI);
+    float sin_thetaT = etaI/etaT*sin_thetaI;
+    if (sin_thetaT >= 1)
+	return 1;
+    float cos_thetaT = sqrt(1-sin_thetaT*sin_thetaT);
+    float r_parallel = ((etaT*cos_thetaI) - (etaI*cos_thetaT)) / ((etaT*cos_thetaI) + (etaI*cos_thetaT));
+    float r_perpendicular = ((etaI*cos_thetaI) - (etaT*cos_thetaT)) / ((etaI*cos_thetaI) + (etaT*cos_thetaT));
+    return (r_parallel*r_parallel + r_perpendicular*r_perpendicular) / 2;
+}
+
+static float3 global_to_local(float3 normal, float3 vec){
+    float3 z = normal;
+    float3 y = normalize(cross(z, (fabs(fabs(z.z) - 1) < 0.0001) ? float3({1,0,0}) : float3({0,0,1})));
+    float3 x = cross(y,z);
+    return {dot(x,vec), dot(y,vec), dot(z,vec)};
+}
+
+static float3 local_to_global(float3 normal, float3 vec){
+    float3 z = normal;
+    float3 y = normalize(cross(z, (fabs(fabs(z.z) - 1) < 0.0001) ? float3({1,0,0}) : float3({0,0,1})));
+    float3 x = cross(y,z);
+    return vec.x*x + vec.y*y + vec.z*z;
+}
+
+static float3 sample_lambertian(float3 normal, float phi, float xi, float& bxdf){
+    float costheta = acos(xi)*2/M_PI;
+    float sintheta = sqrt(1-costheta*costheta);
+    bxdf = costheta*costheta/M_PI*2/sqrt(1-xi*xi);
+    return local_to_global(normal, {sintheta*cosf(phi), sintheta*sinf(phi), costheta});
+}
+
+static float3 sample_cook_torrance(float3 normal, float3 win, const Material& mat, float phi, float xi, float& bxdf){
+    float tan2theta = -mat.alpha*mat.alpha*log(xi);
+    float costheta = 1/sqrt(1+tan2theta);
+    float sintheta = sqrt(1-costheta*costheta);
+
+    float3 w_half = {sintheta*cosf(phi), sintheta*sinf(phi), costheta};
+    if (win.z*w_half.z < 0) w_half = -w_half;
+
+    float3 wout = -win + 2*dot(win,w_half)*w_half;
+
+    if (cos_theta(wout)*cos_theta(win) < 0)
+	bxdf = 0;
+    else
+	bxdf = G(win, wout, mat)/cos_theta(win)/fabs(cos_theta(w_half))*dot(win,w_half);
+
+    return local_to_global(normal, wout);
+}
+
+static float3 get_direction(float3 normal, float3 in, const Material& mat, float& bxdf, RandState& rand_state,
+			    bool& transmitted, const Material& current, const SceneFeatures& features){
+    float3 win = -global_to_local(normal, in);
+    if (features.refraction){
+	float ref_type = rand_float(rand_state);
+	float etaI;
+	float etaT;
+	float3 nl;
+	if (win.z < 0){ // leaving
+	    nl = {0,0,-1};
+	    etaI = mat.ref_idx;
+	    etaT = current.ref_idx;
+	}
+	else{ // entering
+	    nl = {0,0,1};
+	    etaI = current.ref_idx;
+	    etaT = mat.ref_idx;
+	}
+	if (ref_type > F(etaI, etaT, fabs(cos_theta(win)))){
+	    transmitted = true;
+	    bxdf = 1;
+	    float dt = fabs(cos_theta(win));
+	    float ratio = etaI/etaT;
+	    float disc = 1.0 - ratio*ratio*(1-dt*dt);
+	    float3 refracted = ratio*(-win + dt*nl) - sqrt(disc)*nl;
+	    return local_to_global(normal, refracted);
+	}
+    }
+    float phi = 2*M_PI*rand_float(rand_state);
+    float xi = rand_float(rand_state);
+    if (mat.type == LAMBERTIAN)
+	return sample_lambertian(normal, phi, xi, bxdf);
+    return sample_cook_torrance(normal, win, mat, phi, xi, bxdf);
+}
+
+static bool hit_data(const Scene& scene, float t, int id, HitData& dat){
+    if (id < 0)
+	return false;
+    const Triangle& tri = scene.bvh.ordered[id];
+    dat.t = t;
+    dat.normal = normalize(cross(tri.vert1 - tri.vert0, tri.vert2 - tri.vert0));
+    dat.mat = tri.material;
+    return true;
+}
+
+// the pixel of the map a direction falls in and the chance of sampling the
+// direction, per unit solid angle
+static long env_pixel(const Environment& env, float3 dir, float& pdf){
+    float u = atan2f(dir.x, -dir.z)/(2*M_PI) + 0.5f;
+    float v = acosf(std::min(std::max(dir.y, -1.0f), 1.0f))/M_PI;
+    int x = std::min((int)(u*env.width), env.width - 1);
+    int y = std::min((int)(v*env.height), env.height - 1);
+    long i = (long)y*env.width + x;
+    float sin_theta = sqrt(std::max(1 - dir.y*dir.y, 0.0f));
+    pdf = sin_theta > 0 ? env.table[i].pdf*env.width*env.height/(2*M_PI*M_PI*sin_theta) : 0;
+    return i;
+}
+
+// a direction towards the map, picked in proportion to the light coming from it
+static float3 sample_env(const Environment& env, RandState& rand_state, float& pdf, long& pixel){
+    long n = (long)env.width*env.height;
+    long i = std::min((long)(rand_float(rand_state)*n), n - 1);
+    if (rand_float(rand_state) >= env.table[i].keep)
+	i = env.table[i].alias;
+    float u = (i%env.width + rand_float(rand_state))/env.width;
+    float v = (i/env.width + rand_float(rand_state))/env.height;
+    float phi = (u - 0.5f)*2*M_PI;
+    float theta = v*M_PI;
+    float sin_theta = sinf(theta);
+    pdf = sin_theta > 0 ? env.table[i].pdf*n/(2*M_PI*M_PI*sin_theta) : 0;
+    pixel = i;
+    return {sin_theta*sinf(phi), cosf(theta), -sin_theta*cosf(phi)};
+}
+
+// the chance of sample_lambertian picking a direction at cos_theta from the
+// normal, and what it weighs the light from there by
+static float lambertian_pdf(float cos_theta){
+    return cos_theta > 0 ? sinf(cos_theta*M_PI/2)/4 : 0;
+}
+
+static float power_heuristic(float pdf, float other){
+    return pdf*pdf/(pdf*pdf + other*other);
+}
+
+// stack has room for max_bounces + 1 materials, it's passed in so it is only allocated once per task.
+// the first hit of the ray, t and id, comes from the packet traversal, the bounces are traced alone.
+// what the first hit was is written to first and the AOVs to aov when they aren't NULL
+static float3 trace(const Scene& scene, const WideBVH& bvh, Ray ray, float t, int id, RandState& rand_state,
+		    const SceneFeatures& features, int max_bounces, std::vector<Material>& stack, Features* first, AOVs* aov){
+    float3 color = {0,0,0};
+    float3 mask = {1,1,1};
+    if (aov)
+	*aov = {{0,0,0}, -1};
+    const Environment& env = scene.environment;
+    float bounce_pdf = 0; // of the last bounce when it also sampled the map, otherwise 0
+    int stack_idx = 0;
+    stack[0].ref_idx = 1;
+    stack[0].attenuation = {0,0,0};
+    for (int bounces = 0; bounces < max_bounces; ++bounces){
+	HitData dat;
+	if (bounces > 0)
+	    bvh.intersect(ray, t, id);
+	if (hit_data(scene, t, id, dat)){
+	    const Material& mat = scene.materials[dat.mat];
+	    if (first && bounces == 0){
+		first->albedo = mat.color;
+		first->normal = dot(dat.normal, ray.direction) < 0 ? dat.normal : -dat.normal;
+		first->depth = dat.t;
+	    }
+	    if (aov && bounces == 0)
+		aov->material = dat.mat;
+	    ray.origin = ray.origin + dat.t*ray.direction;
+
+	    float bxdf;
+	    bool transmitted = false;
+	    float3 new_direction = get_direction(dat.normal, ray.direction, mat, bxdf, rand_state, transmitted,
+						 features.refraction ? stack[stack_idx] : mat, features);
+	    if (features.refraction){
+		float3 atten = stack[stack_idx].attenuation;
+		if (transmitted){
+		    if (dot(dat.normal, ray.direction) < 0)
+			stack[++stack_idx] = mat;
+		    else if (stack_idx > 0)
+			stack_idx--;
+		}
+		else if (dot(dat.normal, ray.direction) < 0)
+		    ray.origin += 0.000001f*dat.normal;
+		mask = mask*float3({expf(-atten.x*dat.t), expf(-atten.y*dat.t), expf(-atten.z*dat.t)});
+	    }
+	    else if (dot(dat.normal, ray.direction) < 0)
+		ray.origin += 0.000001f*dat.normal;
+
+	    color += mask*mat.emission;
+	    if (aov && bounces <= 1)
+		aov->direct = color;
+	    // next event estimation on diffuse surfaces, weighed against the
+	    // bounce hitting the same part of the map
+	    bounce_pdf = 0;
+	    if (features.environment && mat.type == LAMBERTIAN && mat.ref_idx == 0){
+		float light_pdf;
+		long pixel;
+		float3 dir = sample_env(env, rand_state, light_pdf, pixel);
+		float cos_theta = dot(dat.normal, dir);
+		float shadow_t;
+		int shadow_id;
+		if (cos_theta > 0 && light_pdf > 0 && !bvh.intersect({ray.origin, dir}, shadow_t, shadow_id)){
+		    float weight = cos_theta*cos_theta/(2*M_PI)/light_pdf*power_heuristic(light_pdf, lambertian_pdf(cos_theta));
+		    color += weight*(mask*mat.color*env.pixels[pixel]);
+		}
+		bounce_pdf = lambertian_pdf(dot(dat.normal, new_direction));
+		if (aov && bounces == 0)
+		    aov->direct = color;
+	    }
+	    mask = bxdf*(mask*mat.color);
+	    ray.direction = new_direction;
+	}
+	else{
+	    float3 sky;
+	    float light_pdf = 0;
+	    if (features.environment)
+		sky = env.pixels[env_pixel(env, ray.direction, light_pdf)];
+	    else{
+		float up = (ray.direction.y + 1)/2;
+		sky = (1-up)*float3({1,1,1}) + up*float3({0.5,0.7,1});
+	    }
+	    if (first && bounces == 0)
+		*first = {sky, {0,0,0}, 0};
+	    if (bounce_pdf > 0)
+		sky = power_heuristic(bounce_pdf, light_pdf)*sky;
+	    if (aov && bounces <= 1)
+		aov->direct = color + mask*sky;
+	    return color + mask*sky;
+	}
+	if (mask.x + mask.y + mask.z < 0.01) break;
+    }
+    return color;
+}
+
+static Ray camera_ray(const RayGen& camera, int x, int y, int width, int height, RandState& rand_state,
+		      const SceneFeatures& features){
+    Ray ray;
+    if (camera.type == PANORAMIC){
+	float xs = rand_float(rand_state);
+	float ys = rand_float(rand_state);
+	float phi = (2*(x+xs)/width - 1)*M_PI;
+	float theta = ((y+ys)/height - 0.5f)*M_PI;
+	ray.origin = camera.origin;
+	ray.direction = (cosf(theta)*sinf(phi))*camera.u + sinf(theta)*camera.v - (cosf(theta)*cosf(phi))*camera.w;
+	return ray;
+    }
+
+    ray.origin = camera.origin;
+    if (features.lens && camera.type == PERSPECTIVE){
+	float theta = 2*M_PI*rand_float(rand_state);
+	float rad = camera.lens_radius*rand_float(rand_state);
+	ray.origin += rad*(cosf(theta)*camera.u + sinf(theta)*camera.v);
+    }
+
+    float xs = rand_float(rand_state);
+    float ys = rand_float(rand_state);
+    float3 target = camera.screen_corner + ((x+xs)/width)*camera.horiz + ((y+ys)/height)*camera.vert;
+
+    if (camera.type == ORTHOGRAPHIC){
+	ray.origin = target;
+	ray.direction = -camera.w;
+    }
+    else
+	ray.direction = normalize(target - ray.origin);
+    return ray;
+}
+
+static float luminance(float3 c){
+    return dot(c, {0.2126f, 0.7152f, 0.0722f});
+}
+
+CPURenderer::CPURenderer(const RenderOptions& opts) : Renderer(opts), isa(best_isa()){
+    std::clog << "Using CPU backend with " << pool.size() << " threads (" << isa_name(isa) << ")" << std::endl;
+}
+
+// same as the render kernel, a work-item per pixel of the tile. the camera
+// rays of a block of 8x8 pixels are coherent, so they are traced together as
+// a packet and only the bounces after the first hit are traced one by one.
+void CPURenderer::trace_tile(const Tile& tile, int batch, std::vector<Material>& stack){
+    const int block = 8;
+    Ray rays[PACKET_SIZE];
+    RandState states[PACKET_SIZE];
+    int pixels[PACKET_SIZE];
+    float t[PACKET_SIZE];
+    int id[PACKET_SIZE];
+    float3 color[PACKET_SIZE];
+    float sq_lum[PACKET_SIZE];
+    Features first[PACKET_SIZE];
+    Features first_sum[PACKET_SIZE];
+    AOVs aov[PACKET_SIZE];
+    float3 direct_sum[PACKET_SIZE];
+    int64_t fixed[PACKET_SIZE][3];
+    const bool accumulate = !fixed_sum.empty();
+    for (int by = 0; by < tile.height; by += block){
+	for (int bx = 0; bx < tile.width; bx += block){
+	    int count = 0;
+	    for (int ty = by; ty < std::min(by + block, tile.height); ++ty){
+		for (int tx = bx; tx < std::min(bx + block, tile.width); ++tx){
+		    int pixel = (tile.y - band_y + ty)*width + tile.x + tx;
+		    if (!active[pixel])
+			continue;
+		    color[count] = {0,0,0};
+		    sq_lum[count] = 0;
+		    first_sum[count] = {{0,0,0}, {0,0,0}, 0};
+		    direct_sum[count] = {0,0,0};
+		    fixed[count][0] = fixed[count][1] = fixed[count][2] = 0;
+		    pixels[count++] = pixel;
+		}
+	    }
+	    if (!count)
+		continue;
+	    for (int sample = 0; sample < batch; ++sample){
+		for (int i = 0; i < count; ++i){
+		    // pixels are numbered from the band, seeds and rays go by the image
+		    int pixel = band_y*width + pixels[i];
+		    int x = pixel%width;
+		    int y = height - pixel/width - 1;
+		    states[i] = rand_init(pixel, options.first_sample + counts[pixels[i]] + sample);
+		    rays[i] = camera_ray(camera, x, y, width, height, states[i], scene_features);
+		}
+		wide_bvh.intersect_packet(rays, count, t, id);
+		for (int i = 0; i < count; ++i){
+		    float3 c = trace(*scene, wide_bvh, rays[i], t[i], id[i], states[i], scene_features, options.max_bounces, stack,
+				     keep_features ? &first[i] : NULL, keep_aovs ? &aov[i] : NULL);
+		    float l = luminance(c);
+		    color[i] += c;
+		    sq_lum[i] += l*l;
+		    if (accumulate)
+			for (int k = 0; k < 3; ++k)
+			    fixed[i][k] += to_fixed(c.s[k]);
+		    if (keep_features){
+			first_sum[i].albedo += first[i].albedo;
+			first_sum[i].normal += first[i].normal;
+			first_sum[i].depth += first[i].depth;
+		    }
+		    if (keep_aovs){
+			direct_sum[i] += aov[i].direct;
+			if (counts[pixels[i]] + sample == 0)
+			    aov_sum[pixels[i]].material = aov[i].material;
+		    }
+		}
+	    }
+	    for (int i = 0; i < count; ++i){
+		sum[pixels[i]] += color[i];
+		sq[pixels[i]] += sq_lum[i];
+		counts[pixels[i]] += batch;
+		if (keep_features){
+		    Features& f = feature_sum[pixels[i]];
+		    f.albedo += first_sum[i].albedo;
+		    f.normal += first_sum[i].normal;
+		    f.depth += first_sum[i].depth;
+		}
+		if (keep_aovs)
+		    aov_sum[pixels[i]].direct += direct_sum[i];
+		if (accumulate)
+		    for (int k = 0; k < 3; ++k)
+			fixed_sum[3*pixels[i] + k] += fixed[i][k];
+	    }
+	}
+    }
+}
+
+// same as the update_mask kernel, returns how many pixels of the tile are still active
+int CPURenderer::update_mask(const Tile& tile, cl_uint max_samples){
+    int still_active = 0;
+    for (int ty = 0; ty < tile.height; ++ty){
+	for (int tx = 0; tx < tile.width; ++tx){
+	    int i = (tile.y - band_y + ty)*width + tile.x + tx;
+	    if (!active[i])
+		continue;
+	    float n = counts[i];
+	    float mean = luminance(sum[i])/n;
+	    float variance = std::max(sq[i]/n - mean*mean, 0.0f);
+	    float error = sqrt(variance/n)/(mean + 0.01f);
+	    if ((error < options.target_error && counts[i] >= MIN_SAMPLES) || counts[i] >= max_samples)
+		active[i] = 0;
+	    else
+		++still_active;
+	}
+    }
+    return still_active;
+}
+
+void CPURenderer::render(Scene& scene){
+    const long pixels = (long)width*height;
+    this->scene = &scene;
+    scene_features = scene.features();
+    camera = prepare_camera(scene.camera);
+    wide_bvh = WideBVH(scene.bvh, isa);
+
+    // small tiles so there are plenty for the threads to share out, bright
+    // or glassy parts of the image take far longer than the background.
+    // streamed output is rendered and written a band of tiles at a time,
+    // otherwise the whole image is one band
+    int tile_size = options.tile_size > 0 ? options.tile_size : 16;
+    const int band_rows = options.stream ? std::min(height, (STREAM_ROWS + tile_size - 1)/tile_size*tile_size) : height;
+    const int num_bands = (height + band_rows - 1)/band_rows;
+    const long band_pixels = (long)width*band_rows;
+    output = std::vector<float3>(band_pixels);
+    counts = std::vector<cl_uint>(band_pixels);
+    sum = std::vector<float3>(band_pixels);
+    sq = std::vector<float>(band_pixels);
+    active = std::vector<cl_uchar>(band_pixels);
+    if (keep_features){
+	feature_sum = std::vector<Features>(band_pixels);
+	features = std::vector<Features>(band_pixels);
+    }
+    if (keep_aovs){
+	aov_sum = std::vector<AOVs>(band_pixels);
+	aovs = std::vector<AOVs>(band_pixels);
+    }
+    // each sample is rounded to fixed point on its own, so the sums don't
+    // depend on how the samples were batched or split between processes
+    if (!options.accumulate_file.empty()){
+	fixed_sum = std::vector<int64_t>(3*band_pixels, 0);
+	scene_hash = scene.hash();
+    }
+    std::vector<std::vector<Material>> stacks(pool.size(), std::vector<Material>(options.max_bounces + 1));
+
+    start_checkpoints(scene);
+
+    std::clog << "Starting render..." << std::endl;
+    std::clog << "  Tiles: " << (long)((width + tile_size - 1)/tile_size)*((height + tile_size - 1)/tile_size)
+	      << " of " << tile_size << "x" << tile_size << std::endl;
+    if (options.stream){
+	std::clog << "  Bands: " << num_bands << " of " << band_rows << " rows" << std::endl;
+	start_stream();
+    }
+
+    // each band is rendered in passes, each adding a batch of samples to
+    // every active pixel. batches are sized the same way as the OpenCL
+    // launches: by the budget, or by time after a pilot pass. a time limit
+    // is shared out evenly between the bands that are left
+    const cl_uint max_samples = sample_cap();
+    const double pass_seconds = 0.5;
+    budget = samples > 0 ? pixels*samples : LONG_MAX;
+    paths_done = 0;
+    converged = 0;
+    double paths_per_second = 0;
+    render_start = std::chrono::system_clock::now();
+    std::chrono::time_point<std::chrono::system_clock> last_preview = render_start;
+
+    for (int b = 0; b < num_bands; ++b){
+	band_y = b*band_rows;
+	const int rows = std::min(band_rows, height - band_y);
+	const long band_size = (long)width*rows;
+	std::fill(counts.begin(), counts.end(), 0);
+	std::fill(sum.begin(), sum.end(), float3({0,0,0}));
+	std::fill(sq.begin(), sq.end(), 0.0f);
+	std::fill(active.begin(), active.end(), 1);
+	if (keep_features)
+	    std::fill(feature_sum.begin(), feature_sum.end(), Features({{0,0,0}, {0,0,0}, 0}));
+	if (keep_aovs)
+	    std::fill(aov_sum.begin(), aov_sum.end(), AOVs({{0,0,0}, -1}));
+	tiles.clear();
+	for (int y = band_y; y < band_y + rows; y += tile_size)
+	    for (int x = 0; x < width; x += tile_size)
+		tiles.push_back({x, y, std::min(tile_size, width - x), std::min(tile_size, band_y + rows - y)});
+	std::vector<int> tile_active(tiles.size());
+	// checkpoints are of the whole image, which is a single band
+	const bool resumed = options.resume && take_checkpoints &&
+	    load_checkpoint(sum.data(), sq.data(), counts.data(), active.data(), feature_sum.data(), aov_sum.data());
+
+	const std::chrono::time_point<std::chrono::system_clock> band_start = std::chrono::system_clock::now();
+	double band_seconds = 0;
+	if (options.time_limit > 0)
+	    band_seconds = (options.time_limit - std::chrono::duration<double>(band_start - render_start).count())/(num_bands - b);
+	const long band_budget = samples > 0 ? band_size*samples : LONG_MAX;
+	long band_paths = resumed ? paths_done : 0;
+	long active_pixels = resumed ? std::count(active.begin(), active.end(), 1) : band_size;
+	// every pass adds the batch to every active pixel, so they all have this many samples
+	cl_uint active_samples = resumed ? lowest_active_count(counts.data(), active.data(), band_size) : 0;
+
+	while (active_pixels > 0 && band_paths < band_budget){
+	    long batch;
+	    std::chrono::time_point<std::chrono::system_clock> start = std::chrono::system_clock::now();
+	    // the pilot pass leaves the mask alone, one sample says nothing of the noise
+	    const bool update = options.target_error > 0 && (options.time_limit <= 0 || paths_per_second > 0);
+	    if (options.time_limit > 0){
+		double remaining = band_seconds - std::chrono::duration<double>(start - band_start).count();
+		if (paths_per_second == 0)
+		    batch = 1; // pilot pass to measure the machine
+		else
+		    batch = paths_per_second*std::min(pass_seconds, remaining)/active_pixels;
+		// a pass takes at least a sample while there is time for one
+		if (batch < 1 && paths_per_second*remaining >= active_pixels)
+		    batch = 1;
+		if (batch < 1)
+		    break;
+	    }
+	    else
+		batch = 8*band_size/active_pixels;
+	    // rounded up without overflowing an unlimited budget, and stopping
+	    // where the next snapshot is due
+	    batch = std::min(batch, (band_budget - band_paths - 1)/active_pixels + 1);
+	    batch = std::min(batch, (snapshot_paths() - paths_done - 1)/active_pixels + 1);
+	    // no pixel goes over its cap, however few are left to share the budget
+	    if (active_samples < max_samples)
+		batch = std::min(batch, (long)(max_samples - active_samples));
+	    batch = std::min(batch, 1024L);
+
+	    pool.run(tiles.size(), [&](int t, int thread){
+		trace_tile(tiles[t], batch, stacks[thread]);
+		if (update)
+		    tile_active[t] = update_mask(tiles[t], max_samples);
+	    });
+
+	    std::chrono::time_point<std::chrono::system_clock> now = std::chrono::system_clock::now();
+	    if (paths_done == 0)
+		first_sample = now;
+	    long paths = batch*active_pixels;
+	    paths_done += paths;
+	    band_paths += paths;
+	    active_samples += batch;
+	    paths_per_second = paths/std::max(std::chrono::duration<double>(now - start).count(), 1e-6);
+	    if (update){
+		active_pixels = 0;
+		for (int a : tile_active)
+		    active_pixels += a;
+	    }
+
+	    if (options.preview_file.size() && std::chrono::duration<double>(now - last_preview).count() >= options.preview_interval){
+		copy_tile({0, band_y, width, rows}, sum.data(), counts.data());
+		save_preview();
+		last_preview = now;
+	    }
+	    // snapshots are of the whole image, which is a single band
+	    std::string label = due_snapshot(paths_done);
+	    if (!label.empty())
+		save_snapshot(sum.data(), counts.data(), label);
+	    print_progress();
+	    if (checkpoint_due()){
+		save_checkpoint(sum.data(), sq.data(), counts.data(), active.data(), feature_sum.data(), aov_sum.data());
+		if (stopped)
+		    return;
+	    }
+	}
+	copy_tile({0, band_y, width, rows}, sum.data(), counts.data(), keep_features ? feature_sum.data() : NULL,
+		  keep_aovs ? aov_sum.data() : NULL);
+	converged += band_size - active_pixels;
+	if (options.stream)
+	    stream_band(rows);
+    }
+    finish_snapshots();
+
+    std::clog << "Progress:  100% Time remaining: 0h0m0.0s      " << std::endl;
+
+    if (options.target_error > 0)
+	std::clog << "  Converged: " << converged << "/" << pixels << " pixels" << std::endl;
+    if (options.target_error > 0 || options.time_limit > 0)
+	std::clog << "  Samples taken: " << (double)paths_done/pixels << " per pixel" << std::endl;
+}
+
+void CPURenderer::save_accumulation(std::string filename){
+    Accumulation acc;
+    acc.scene_hash = scene_hash;
+    acc.width = width;
+    acc.height = height;
+    acc.max_bounces = options.max_bounces;
+    acc.first_sample = options.first_sample;
+    acc.end_sample = options.first_sample + samples;
+    acc.sums = fixed_sum;
+    acc.counts = counts;
+    std::clog << "Saving samples " << acc.first_sample << " to " << acc.end_sample << " to " << filename << std::endl;
+    if (!acc.save(filename))
+	print_error("Unable to save accumulation file " + filename);
+}
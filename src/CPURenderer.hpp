@@ -0,0 +1,37 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "Camera.h"
+#include "Features.h"
+#include "float3.h"
+#include "Renderer.hpp"
+#include "RenderOptions.h"
+#include "Scene.hpp"
+#include "SIMDIntersect.hpp"
+#include "WideBVH.hpp"
+
+// traces paths on the host with a port of render_kernel.cl, split into
+// tiles that the thread pool hands out. needs no OpenCL runtime.
+class CPURenderer : public Renderer{
+private:
+    void trace_tile(const Tile& tile, int batch, std::vector<Material>& stack);
+    int update_mask(const Tile& tile, cl_uint max_samples);
+    std::vector<float3> sum;  // unnormalized colour of each pixel
+    std::vector<float> sq;    // sum of squared luminance of each pixel
+    std::vector<Features> feature_sum; // first hits of each pixel, only when keep_features
+    std::vector<AOVs> aov_sum;         // only when keep_aovs
+    std::vector<cl_uchar> active;
+    std::vector<int64_t> fixed_sum; // sum in fixed point, three for each pixel, only with --accumulate
+    std::vector<Tile> tiles;
+    const Scene* scene;
+    SceneFeatures scene_features;
+    RayGen camera;
+    WideBVH wide_bvh;
+    const ISA isa;
+public:
+    CPURenderer(const RenderOptions& options);
+    void render(Scene& scene);
+    void save_accumulation(std::string filename);
+};
@@ -2,9 +2,31 @@
 
 #include "float3.h"
 
+typedef enum _CameraType{
+	   PERSPECTIVE,
+	   ORTHOGRAPHIC,
+	   PANORAMIC
+} CameraType;
+
 typedef struct _Camera{
     float3 location;
     float3 looking_at;
     float aperture;
     float lens_radius;
+    float focus_distance; // 0 to focus on looking_at
+    CameraType type;
 } Camera;
+
+// camera basis and screen prepared on the host so the kernel only has to
+// interpolate across the screen to make a ray
+typedef struct _RayGen{
+    float3 origin;
+    float3 u;
+    float3 v;
+    float3 w;
+    float3 screen_corner;
+    float3 horiz;
+    float3 vert;
+    float lens_radius;
+    CameraType type;
+} RayGen;
@@ -0,0 +1,203 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "Denoiser.hpp"
+#include "Features.h"
+#include "float3.h"
+#include "ThreadPool.hpp"
+
+const int ITERATIONS = 5;         // footprint of 1 + 4*(2^5 - 1) = 125 pixels
+const int VARIANCE_RADIUS = 3;    // window the noise of each pixel is first estimated over
+const float SIGMA_LUMINANCE = 4;  // in standard deviations of the noise
+const float SIGMA_NORMAL = 0.1;
+const float SIGMA_ALBEDO = 0.05;
+const float SIGMA_DEPTH = 0.02;   // relative to the depth of the pixel being filtered
+const float B3_SPLINE[5] = {1.0f/16, 1.0f/4, 3.0f/8, 1.0f/4, 1.0f/16};
+
+// the lighting, its variance and the features stored by channel, so each row
+// is filtered with the same operations on neighbouring pixels and the
+// compiler vectorizes it
+struct Planes{
+    std::vector<float> r, g, b, variance;
+    Planes(long size) : r(size), g(size), b(size), variance(size){}
+};
+
+struct Guides{
+    std::vector<float> nx, ny, nz, ax, ay, az, depth, inv_depth2;
+    Guides(long size) : nx(size), ny(size), nz(size), ax(size), ay(size), az(size), depth(size), inv_depth2(size){}
+};
+
+// e^x for x <= 0, to a few ulps of single precision without a call so the
+// loop it is in stays vectorized
+static inline float fast_exp(float x){
+    x = 0.5f*(x - 80 + fabsf(x + 80)); // max(x, -80) without a compare, which would stop vectorization
+    x *= 1.44269504f;
+    int whole = (int)x; // rounds toward zero, so the fraction is in (-1, 0]
+    float f = x - whole;
+    float p = 1 + f*(0.69314718f + f*(0.24022651f + f*(0.05550411f + f*(0.00961813f + f*0.00133336f))));
+    union{
+	int32_t bits;
+	float scale; // 2^whole
+    } u;
+    u.bits = (whole + 127) << 23;
+    return p*u.scale;
+}
+
+static inline float luminance(float r, float g, float b){
+    return 0.2126f*r + 0.7152f*g + 0.0722f*b;
+}
+
+// one row of one iteration, every tap of the 5x5 B3 spline kernel spread out
+// by step. luminance differences are measured against the noise left in the
+// pixel, which shrinks as the variance is filtered along with the lighting.
+__attribute__((target_clones("avx2", "default")))
+static void filter_row(const Planes& in, Planes& out, const Guides& guides, int width, int height, int y, int step){
+    const float inv_normal = 1/(SIGMA_NORMAL*step*step);
+    const float inv_albedo = 1/SIGMA_ALBEDO;
+    const float inv_depth = 1/(SIGMA_DEPTH*SIGMA_DEPTH);
+    const long row = (long)y*width;
+    std::vector<float> sums(5*width, 0);
+    std::vector<float> centre(2*width);
+    float* sum_r = &sums[0];
+    float* sum_g = &sums[width];
+    float* sum_b = &sums[2*width];
+    float* sum_v = &sums[3*width];
+    float* sum_w = &sums[4*width];
+    float* lum = &centre[0];
+    float* inv_sigma = &centre[width];
+    for (int x = 0; x < width; ++x){
+	long p = row + x;
+	lum[x] = luminance(in.r[p], in.g[p], in.b[p]);
+	inv_sigma[x] = 1/(SIGMA_LUMINANCE*sqrtf(in.variance[p]) + 1e-4f);
+    }
+    // this row, and below the row of the tap shifted by its offset, so the
+    // loop over the row only does contiguous loads
+    const float* nx = guides.nx.data() + row;
+    const float* ny = guides.ny.data() + row;
+    const float* nz = guides.nz.data() + row;
+    const float* ax = guides.ax.data() + row;
+    const float* ay = guides.ay.data() + row;
+    const float* az = guides.az.data() + row;
+    const float* depth = guides.depth.data() + row;
+    const float* inv_depth2 = guides.inv_depth2.data() + row;
+    for (int ky = -2; ky <= 2; ++ky){
+	int qy = y + ky*step;
+	if (qy < 0 || qy >= height)
+	    continue;
+	for (int kx = -2; kx <= 2; ++kx){
+	    const int dx = kx*step;
+	    const long offset = (long)qy*width + dx;
+	    const float kernel = B3_SPLINE[ky + 2]*B3_SPLINE[kx + 2];
+	    const float* r = in.r.data() + offset;
+	    const float* g = in.g.data() + offset;
+	    const float* b = in.b.data() + offset;
+	    const float* v = in.variance.data() + offset;
+	    const float* qnx = guides.nx.data() + offset;
+	    const float* qny = guides.ny.data() + offset;
+	    const float* qnz = guides.nz.data() + offset;
+	    const float* qax = guides.ax.data() + offset;
+	    const float* qay = guides.ay.data() + offset;
+	    const float* qaz = guides.az.data() + offset;
+	    const float* qdepth = guides.depth.data() + offset;
+	    // only the pixels whose tap lands inside the image
+	    const int x0 = std::max(0, -dx);
+	    const int x1 = std::min(width, width - dx);
+	    // the sums never overlap what is read
+#pragma GCC ivdep
+	    for (int x = x0; x < x1; ++x){
+		float dl = luminance(r[x], g[x], b[x]) - lum[x];
+		float dnx = qnx[x] - nx[x];
+		float dny = qny[x] - ny[x];
+		float dnz = qnz[x] - nz[x];
+		float dax = qax[x] - ax[x];
+		float day = qay[x] - ay[x];
+		float daz = qaz[x] - az[x];
+		float dz = qdepth[x] - depth[x];
+		float e = fabsf(dl)*inv_sigma[x]
+		    + (dnx*dnx + dny*dny + dnz*dnz)*inv_normal
+		    + (dax*dax + day*day + daz*daz)*inv_albedo
+		    + dz*dz*inv_depth2[x]*inv_depth;
+		float w = kernel*fast_exp(-e);
+		sum_r[x] += w*r[x];
+		sum_g[x] += w*g[x];
+		sum_b[x] += w*b[x];
+		sum_v[x] += w*w*v[x];
+		sum_w[x] += w;
+	    }
+	}
+    }
+    // the centre tap always has full weight, so sum_w is never zero
+    for (int x = 0; x < width; ++x){
+	float inv = 1/sum_w[x];
+	out.r[row + x] = sum_r[x]*inv;
+	out.g[row + x] = sum_g[x]*inv;
+	out.b[row + x] = sum_b[x]*inv;
+	out.variance[row + x] = sum_v[x]*inv*inv;
+    }
+}
+
+// variance of the luminance around each pixel, over neighbours on the same
+// surface. a pixel's own samples aren't kept, so this stands in for how
+// noisy it is.
+static void estimate_variance(Planes& planes, const Guides& guides, int width, int height, int y){
+    for (int x = 0; x < width; ++x){
+	long p = (long)y*width + x;
+	float sum = 0, sum_sq = 0, n = 0;
+	for (int qy = std::max(0, y - VARIANCE_RADIUS); qy <= std::min(height - 1, y + VARIANCE_RADIUS); ++qy){
+	    for (int qx = std::max(0, x - VARIANCE_RADIUS); qx <= std::min(width - 1, x + VARIANCE_RADIUS); ++qx){
+		long q = (long)qy*width + qx;
+		float dnx = guides.nx[q] - guides.nx[p];
+		float dny = guides.ny[q] - guides.ny[p];
+		float dnz = guides.nz[q] - guides.nz[p];
+		if (dnx*dnx + dny*dny + dnz*dnz > SIGMA_NORMAL)
+		    continue;
+		float l = luminance(planes.r[q], planes.g[q], planes.b[q]);
+		sum += l;
+		sum_sq += l*l;
+		n++;
+	    }
+	}
+	float mean = sum/n;
+	planes.variance[p] = std::max(sum_sq/n - mean*mean, 0.0f);
+    }
+}
+
+void denoise(std::vector<float3>& image, const std::vector<Features>& features, int width, int height, ThreadPool& pool){
+    const long pixels = (long)width*height;
+    Planes lighting(pixels);
+    Planes temp(pixels);
+    Guides guides(pixels);
+    const float eps = 0.001;
+    for (long i = 0; i < pixels; ++i){
+	const Features& f = features[i];
+	lighting.r[i] = image[i].x/(f.albedo.x + eps);
+	lighting.g[i] = image[i].y/(f.albedo.y + eps);
+	lighting.b[i] = image[i].z/(f.albedo.z + eps);
+	guides.nx[i] = f.normal.x;
+	guides.ny[i] = f.normal.y;
+	guides.nz[i] = f.normal.z;
+	guides.ax[i] = f.albedo.x;
+	guides.ay[i] = f.albedo.y;
+	guides.az[i] = f.albedo.z;
+	guides.depth[i] = f.depth;
+	guides.inv_depth2[i] = 1/(f.depth*f.depth + eps);
+    }
+
+    pool.run(height, [&](int y, int thread){
+	estimate_variance(lighting, guides, width, height, y);
+    });
+    for (int i = 0; i < ITERATIONS; ++i){
+	int step = 1 << i;
+	pool.run(height, [&](int y, int thread){
+	    filter_row(lighting, temp, guides, width, height, y, step);
+	});
+	std::swap(lighting, temp);
+    }
+
+    for (long i = 0; i < pixels; ++i){
+	const Features& f = features[i];
+	image[i] = {lighting.r[i]*(f.albedo.x + eps), lighting.g[i]*(f.albedo.y + eps), lighting.b[i]*(f.albedo.z + eps)};
+    }
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <vector>
+
+#include "Features.h"
+#include "float3.h"
+#include "ThreadPool.hpp"
+
+// edge-avoiding a-trous wavelet filter, Dammertz et al. 2010. the lighting
+// (the image divided by the albedo) is blurred over wider and wider
+// footprints, but only between pixels that see similar colour, normals and
+// depth, then multiplied back by the albedo so texture stays sharp.
+void denoise(std::vector<float3>& image, const std::vector<Features>& features, int width, int height, ThreadPool& pool);
@@ -0,0 +1,10 @@
+#pragma once
+
+// one pixel of an environment map's alias table. a pixel is picked
+// uniformly, then kept or swapped for its alias, which picks every pixel
+// in proportion to the light it sends into the scene. Vose's method
+typedef struct _EnvSample{
+    float keep; // chance of keeping this pixel rather than taking its alias
+    int alias;
+    float pdf;  // chance of picking this pixel in the end
+} EnvSample;
@@ -0,0 +1,65 @@
+#include <string>
+#include <vector>
+
+#include <cmath>
+
+#include "Environment.hpp"
+#include "EnvSample.h"
+#include "error.hpp"
+#include "float3.h"
+#include "ImageFile.hpp"
+
+void Environment::load(std::string filename, float intensity){
+    if (!load_image(filename, width, height, pixels))
+	print_error("Unable to read environment map " + filename);
+    for (float3& p : pixels)
+	p = intensity*p;
+    build_table();
+}
+
+// pixels near the poles cover less of the sphere, so they are weighted by
+// sin theta as well as by how bright they are
+void Environment::build_table(){
+    const long n = (long)width*height;
+    std::vector<double> weight(n);
+    double total = 0;
+    for (int y = 0; y < height; ++y){
+	double sin_theta = sin(M_PI*(y + 0.5)/height);
+	for (int x = 0; x < width; ++x){
+	    const float3& p = pixels[(long)y*width + x];
+	    weight[(long)y*width + x] = (0.2126*p.x + 0.7152*p.y + 0.0722*p.z)*sin_theta;
+	    total += weight[(long)y*width + x];
+	}
+    }
+    if (!(total > 0))
+	print_error("Environment map has no light in it");
+
+    // scaled so the average pixel is 1, then the light ones give away their
+    // excess to fill up the dark ones
+    table = std::vector<EnvSample>(n);
+    std::vector<double> scaled(n);
+    std::vector<long> small, large;
+    for (long i = 0; i < n; ++i){
+	table[i].pdf = weight[i]/total;
+	table[i].alias = i;
+	scaled[i] = weight[i]/total*n;
+	(scaled[i] < 1 ? small : large).push_back(i);
+    }
+    while (!small.empty() && !large.empty()){
+	long s = small.back();
+	long l = large.back();
+	small.pop_back();
+	table[s].keep = scaled[s];
+	table[s].alias = l;
+	scaled[l] -= 1 - scaled[s];
+	if (scaled[l] < 1){
+	    large.pop_back();
+	    small.push_back(l);
+	}
+    }
+    // whatever is left is 1 up to rounding
+    for (long i : small)
+	table[i].keep = 1;
+    for (long i : large)
+	table[i].keep = 1;
+}
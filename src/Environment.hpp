@@ -0,0 +1,23 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "EnvSample.h"
+#include "float3.h"
+
+// an equirectangular HDR image lighting the scene from infinitely far away,
+// +y is up and the middle of the image looks down -z. the alias table lets
+// paths aim at the bright parts of the map instead of finding them by chance
+class Environment{
+private:
+    void build_table();
+public:
+    int width;
+    int height;
+    std::vector<float3> pixels; // top row first, empty without a map
+    std::vector<EnvSample> table;
+    Environment() : width(0), height(0){}
+    void load(std::string filename, float intensity);
+    bool empty() const {return pixels.empty();}
+};
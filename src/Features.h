@@ -0,0 +1,17 @@
+#pragma once
+
+#include "float3.h"
+
+// what the camera ray of a path hit first, summed over the samples of a
+// pixel. the denoiser uses it to tell edges from noise.
+typedef struct _Features{
+    float3 albedo; // colour of the surface, or of the sky for a miss
+    float3 normal; // facing the camera, zero for a miss
+    float depth;   // distance along the camera ray, zero for a miss
+} Features;
+
+// the rest of what can be saved as AOVs, only kept when they are asked for
+typedef struct _AOVs{
+    float3 direct; // light from emitters or the sky reached within one bounce, summed over samples
+    int material;  // what the camera ray of the pixel's first sample hit, -1 for a miss
+} AOVs;
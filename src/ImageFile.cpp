@@ -0,0 +1,526 @@
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <cmath>
+#include <zlib.h>
+
+#include "float3.h"
+#include "ImageFile.hpp"
+#include "ThreadPool.hpp"
+
+const int PNG_BLOCK_BYTES = 1 << 18; // filtered bytes deflated by one task
+const int DEFLATE_WINDOW = 1 << 15;
+
+ImageFormat image_format(std::string filename){
+    size_t dot = filename.rfind(".");
+    std::string extension = dot == std::string::npos ? "" : filename.substr(dot + 1);
+    std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+    if (extension == "ppm")
+	return PPM;
+    if (extension == "pfm")
+	return PFM;
+    if (extension == "exr")
+	return EXR;
+    return PNG;
+}
+
+// EXR is little endian throughout
+static void put_int(std::string& out, int32_t v){
+    for (int i = 0; i < 4; ++i)
+	out += (char)((v >> 8*i) & 0xff);
+}
+
+static void put_long(std::string& out, uint64_t v){
+    for (int i = 0; i < 8; ++i)
+	out += (char)((v >> 8*i) & 0xff);
+}
+
+static void put_float(std::string& out, float v){
+    union{
+	float f;
+	int32_t i;
+    } u;
+    u.f = v;
+    put_int(out, u.i);
+}
+
+// rounded to nearest even. too big for a half becomes infinity and NaN stays NaN
+static uint16_t to_half(float value){
+    union{
+	float f;
+	uint32_t u;
+    } v;
+    v.f = value;
+    const uint32_t sign = v.u & 0x80000000u;
+    v.u ^= sign;
+    uint16_t h;
+    if (v.u >= 0x47800000u) // 65536 and up, infinity or NaN
+	h = v.u > 0x7f800000u ? 0x7e00 : 0x7c00;
+    else if (v.u < 0x38800000u){ // below the smallest normal half
+	// adding 0.5 shifts the subnormal half's bits to the bottom of the
+	// mantissa and leaves the rounding to the fpu
+	v.f += 0.5f;
+	h = v.u - 0x3f000000u;
+    }
+    else{
+	const uint32_t odd = (v.u >> 13) & 1;
+	v.u += ((uint32_t)(15 - 127) << 23) + 0xfff + odd;
+	h = v.u >> 13;
+    }
+    return h | (sign >> 16);
+}
+
+static void put_attribute(std::string& out, std::string name, std::string type, const std::string& value){
+    out += name + '\0' + type + '\0';
+    put_int(out, value.size());
+    out += value;
+}
+
+// the header and the table of line offsets of an uncompressed scanline
+// file with the channels given in sorted order
+static std::string exr_header(int width, int height, const std::vector<std::string>& names, bool half){
+    std::string header = "\x76\x2f\x31\x01";
+    put_int(header, 2); // version 2, single part scanline
+
+    std::string chlist;
+    for (const std::string& name : names){
+	chlist += name + '\0';
+	put_int(chlist, half ? 1 : 2); // HALF or FLOAT
+	chlist += std::string(4, '\0'); // pLinear and reserved
+	put_int(chlist, 1); // x sampling
+	put_int(chlist, 1); // y sampling
+    }
+    chlist += '\0';
+    put_attribute(header, "channels", "chlist", chlist);
+    put_attribute(header, "compression", "compression", std::string(1, '\0')); // none
+    std::string window;
+    put_int(window, 0);
+    put_int(window, 0);
+    put_int(window, width - 1);
+    put_int(window, height - 1);
+    put_attribute(header, "dataWindow", "box2i", window);
+    put_attribute(header, "displayWindow", "box2i", window);
+    put_attribute(header, "lineOrder", "lineOrder", std::string(1, '\0')); // increasing y
+    std::string value;
+    put_float(value, 1);
+    put_attribute(header, "pixelAspectRatio", "float", value);
+    value.clear();
+    put_float(value, 0);
+    put_float(value, 0);
+    put_attribute(header, "screenWindowCenter", "v2f", value);
+    value.clear();
+    put_float(value, 1);
+    put_attribute(header, "screenWindowWidth", "float", value);
+    header += '\0';
+
+    // without compression every block is one scanline of all the channels in turn
+    const int line_bytes = names.size()*width*(half ? 2 : 4);
+    const uint64_t first_line = header.size() + 8*(uint64_t)height;
+    for (int y = 0; y < height; ++y)
+	put_long(header, first_line + (uint64_t)y*(8 + line_bytes));
+    return header;
+}
+
+// count values step floats apart, as halves or floats
+static void put_values(std::string& out, const float* values, int count, int step, bool half){
+    for (int i = 0; i < count; ++i){
+	if (half){
+	    uint16_t h = to_half(values[(long)i*step]);
+	    out += (char)(h & 0xff);
+	    out += (char)(h >> 8);
+	}
+	else
+	    put_float(out, values[(long)i*step]);
+    }
+}
+
+bool save_exr(std::string filename, int width, int height, std::vector<ImageChannel> channels, bool half){
+    // readers expect the channels sorted by name, pixels are stored in that order too
+    std::sort(channels.begin(), channels.end(), [](const ImageChannel& a, const ImageChannel& b){
+	return a.name < b.name;
+    });
+    std::vector<std::string> names;
+    for (const ImageChannel& c : channels)
+	names.push_back(c.name);
+
+    std::ofstream file(filename, std::ios::binary);
+    if (!file)
+	return false;
+    std::string header = exr_header(width, height, names, half);
+    file.write(header.data(), header.size());
+    const int line_bytes = channels.size()*width*(half ? 2 : 4);
+    std::string line;
+    line.reserve(8 + line_bytes);
+    for (int y = 0; y < height; ++y){
+	line.clear();
+	put_int(line, y);
+	put_int(line, line_bytes);
+	for (const ImageChannel& c : channels)
+	    put_values(line, c.data.data() + (long)y*width, width, 1, half);
+	file.write(line.data(), line.size());
+    }
+    return (bool)file;
+}
+
+// PNG is big endian
+static void put_be(std::string& out, uint32_t v){
+    for (int i = 3; i >= 0; --i)
+	out += (char)((v >> 8*i) & 0xff);
+}
+
+static std::string png_chunk(const char* type, const std::string& data){
+    std::string chunk;
+    put_be(chunk, data.size());
+    chunk += std::string(type, 4) + data;
+    uLong crc = crc32(0, (const Bytef*)type, 4);
+    crc = crc32(crc, (const Bytef*)data.data(), data.size());
+    put_be(chunk, crc);
+    return chunk;
+}
+
+static inline unsigned char paeth(int a, int b, int c){
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+}
+
+// one filter type applied to a row, with the sum of its bytes taken as
+// signed. each type has its own loop so they vectorize
+__attribute__((target_clones("avx2", "default")))
+static long filter_candidate(int type, const unsigned char* row, const unsigned char* above, int stride, int bpp, unsigned char* out){
+    // the first pixel has nothing to its left
+    for (int i = 0; i < bpp; ++i)
+	out[i] = row[i] - (type == 2 || type == 4 ? above[i] : type == 3 ? above[i]/2 : 0);
+    switch (type){
+    case 0:
+	std::copy(row + bpp, row + stride, out + bpp);
+	break;
+    case 1:
+	for (int i = bpp; i < stride; ++i)
+	    out[i] = row[i] - row[i - bpp];
+	break;
+    case 2:
+	for (int i = bpp; i < stride; ++i)
+	    out[i] = row[i] - above[i];
+	break;
+    case 3:
+	for (int i = bpp; i < stride; ++i)
+	    out[i] = row[i] - (row[i - bpp] + above[i])/2;
+	break;
+    default:
+	for (int i = bpp; i < stride; ++i)
+	    out[i] = row[i] - paeth(row[i - bpp], above[i], above[i - bpp]);
+    }
+    long sum = 0;
+    for (int i = 0; i < stride; ++i)
+	sum += out[i] < 128 ? out[i] : 256 - out[i];
+    return sum;
+}
+
+// a filter type byte then the filtered row. every filter is tried and the one
+// with the smallest sum is kept, as lodepng does. above is all zero for the
+// first row
+static void filter_row(const unsigned char* row, const unsigned char* above, int stride, int bpp, unsigned char* out,
+		       std::vector<unsigned char>& candidate){
+    long best_sum = -1;
+    for (int type = 0; type < 5; ++type){
+	long sum = filter_candidate(type, row, above, stride, bpp, candidate.data());
+	if (best_sum < 0 || sum < best_sum){
+	    best_sum = sum;
+	    out[0] = type;
+	    std::copy(candidate.begin(), candidate.begin() + stride, out + 1);
+	}
+    }
+}
+
+ImageWriter::ImageWriter(std::string filename, int width, int height, ThreadPool& pool, bool half, bool alpha) :
+    file(filename, std::ios::binary), format(image_format(filename)), width(width), height(height), half(half),
+    alpha(alpha), pool(pool), rows_done(0), failed(!file){
+    if (format == PPM)
+	file << "P6\n" << width << " " << height << "\n255\n";
+    else if (format == PFM){
+	uint32_t one = 1;
+	const bool little_endian = *(unsigned char*)&one == 1;
+	file << "PF\n" << width << " " << height << "\n" << (little_endian ? "-1.0" : "1.0") << "\n";
+	data_start = file.tellp();
+    }
+    else if (format == EXR){
+	std::string header = exr_header(width, height, {"B", "G", "R"}, half);
+	file.write(header.data(), header.size());
+    }
+    else{
+	file.write("\x89PNG\r\n\x1a\n", 8);
+	std::string header;
+	put_be(header, width);
+	put_be(header, height);
+	header += '\x08'; // 8 bits per channel
+	header += alpha ? '\x06' : '\x02'; // RGBA or RGB
+	header += std::string(3, '\0'); // deflate, adaptive filtering, no interlace
+	std::string chunk = png_chunk("IHDR", header);
+	file.write(chunk.data(), chunk.size());
+	last_row = std::vector<unsigned char>((alpha ? 4 : 3)*(long)width, 0);
+	checksum = adler32(0, NULL, 0);
+    }
+}
+
+void ImageWriter::write(const float3* pixels, int rows){
+    std::string line;
+    for (int j = 0; j < rows; ++j){
+	const float* row = (const float*)(pixels + (long)j*width);
+	const int y = rows_done + j;
+	line.clear();
+	if (format == PFM){
+	    // in the byte order of the host. the rows go from the bottom, so
+	    // each one is put in its place
+	    line.resize(12*(long)width);
+	    for (int x = 0; x < width; ++x)
+		for (int c = 0; c < 3; ++c)
+		    memcpy(&line[4*(3*x + c)], &row[4*x + c], 4);
+	    file.seekp(data_start + (long)(height - 1 - y)*line.size());
+	}
+	else{
+	    put_int(line, y);
+	    put_int(line, 3*width*(half ? 2 : 4));
+	    for (int c = 2; c >= 0; --c)
+		put_values(line, row + c, width, 4, half);
+	}
+	file.write(line.data(), line.size());
+    }
+    rows_done += rows;
+    failed |= !file;
+}
+
+void ImageWriter::write(const unsigned char* rgba, int rows){
+    if (format == PNG)
+	write_png(rgba, rows);
+    else{
+	std::vector<unsigned char> row(3*width);
+	for (int j = 0; j < rows; ++j){
+	    const unsigned char* p = rgba + 4*(long)j*width;
+	    for (int x = 0; x < width; ++x){
+		row[3*x + 0] = p[4*x + 0];
+		row[3*x + 1] = p[4*x + 1];
+		row[3*x + 2] = p[4*x + 2];
+	    }
+	    file.write((const char*)row.data(), row.size());
+	}
+    }
+    rows_done += rows;
+    failed |= !file;
+}
+
+// the filtered rows of the whole image are one zlib stream, cut into blocks
+// that are deflated separately. each block starts from the 32K before it as
+// a dictionary, so matches across the cuts are still found, and all but the
+// last end on a byte boundary with a sync flush so the blocks join up.
+// their checksums are combined into the stream's. the fastest level costs
+// little in size once the rows are filtered
+void ImageWriter::write_png(const unsigned char* rgba, int rows){
+    const int bpp = alpha ? 4 : 3;
+    const long stride = bpp*(long)width;
+    // the row above the band, then the band
+    std::vector<unsigned char> pixels((rows + 1)*stride);
+    std::copy(last_row.begin(), last_row.end(), pixels.begin());
+    for (long i = 0; i < (long)rows*width; ++i)
+	for (int c = 0; c < bpp; ++c)
+	    pixels[stride + bpp*i + c] = rgba[4*i + c];
+    std::copy(pixels.end() - stride, pixels.end(), last_row.begin());
+
+    // the filtered band goes after the end of what came before it
+    const long start = history.size();
+    const int rows_per_block = std::max(1L, PNG_BLOCK_BYTES/(stride + 1));
+    const int blocks = (rows + rows_per_block - 1)/rows_per_block;
+    std::vector<unsigned char> filtered(start + (stride + 1)*rows);
+    std::copy(history.begin(), history.end(), filtered.begin());
+    pool.run(blocks, [&](int block, int thread){
+	std::vector<unsigned char> candidate(stride);
+	for (int y = block*rows_per_block; y < std::min(rows, (block + 1)*rows_per_block); ++y)
+	    filter_row(&pixels[(y + 1)*stride], &pixels[y*stride], stride, bpp, &filtered[start + y*(stride + 1)], candidate);
+    });
+
+    const bool last_band = rows_done + rows == height;
+    std::vector<std::string> deflated(blocks);
+    std::vector<uLong> checksums(blocks);
+    std::vector<bool> block_failed(blocks, false);
+    pool.run(blocks, [&](int block, int thread){
+	const long begin = start + block*rows_per_block*(stride + 1);
+	const long end = std::min((long)filtered.size(), start + (block + 1)*rows_per_block*(stride + 1));
+	const bool last = last_band && block == blocks - 1;
+	z_stream z;
+	memset(&z, 0, sizeof(z));
+	if (deflateInit2(&z, Z_BEST_SPEED, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK){
+	    block_failed[block] = true;
+	    return;
+	}
+	if (begin > 0){
+	    long size = std::min(begin, (long)DEFLATE_WINDOW);
+	    deflateSetDictionary(&z, &filtered[begin - size], size);
+	}
+	std::string& out = deflated[block];
+	out.resize(deflateBound(&z, end - begin) + 16); // room for the sync flush marker
+	z.next_in = &filtered[begin];
+	z.avail_in = end - begin;
+	z.next_out = (Bytef*)&out[0];
+	z.avail_out = out.size();
+	int result = deflate(&z, last ? Z_FINISH : Z_SYNC_FLUSH);
+	block_failed[block] = z.avail_in != 0 || result != (last ? Z_STREAM_END : Z_OK);
+	out.resize(out.size() - z.avail_out);
+	deflateEnd(&z);
+	checksums[block] = adler32(adler32(0, NULL, 0), &filtered[begin], end - begin);
+    });
+
+    // one IDAT per block, the zlib header goes before the first of the image
+    // and the checksum after the last
+    for (int block = 0; block < blocks; ++block){
+	const long begin = start + block*rows_per_block*(stride + 1);
+	const long end = std::min((long)filtered.size(), start + (block + 1)*rows_per_block*(stride + 1));
+	failed |= block_failed[block];
+	checksum = adler32_combine(checksum, checksums[block], end - begin);
+	std::string data;
+	if (rows_done == 0 && block == 0)
+	    data += "\x78\x01"; // deflate with a 32K window, fastest level
+	data += deflated[block];
+	if (last_band && block == blocks - 1)
+	    put_be(data, checksum);
+	std::string chunk = png_chunk("IDAT", data);
+	file.write(chunk.data(), chunk.size());
+    }
+    history.assign(filtered.end() - std::min((long)filtered.size(), (long)DEFLATE_WINDOW), filtered.end());
+}
+
+bool ImageWriter::finish(){
+    if (format == PNG){
+	std::string chunk = png_chunk("IEND", "");
+	file.write(chunk.data(), chunk.size());
+    }
+    file.close();
+    return !failed && rows_done == height && file;
+}
+
+bool save_png(std::string filename, int width, int height, const std::vector<unsigned char>& rgba, ThreadPool& pool){
+    // RGB when every pixel is opaque, as lodepng chooses
+    bool opaque = true;
+    for (long i = 3; i < (long)rgba.size() && opaque; i += 4)
+	opaque = rgba[i] == 255;
+    ImageWriter writer(filename, width, height, pool, false, !opaque);
+    writer.write(rgba.data(), height);
+    return writer.finish();
+}
+
+// radiance RGBE, flat or with the run length encoded scanlines every
+// writer uses for images between 8 and 32767 pixels wide
+static bool load_hdr(std::ifstream& file, int& width, int& height, std::vector<float3>& pixels){
+    std::string line;
+    getline(file, line);
+    if (line != "#?RADIANCE" && line != "#?RGBE")
+	return false;
+    while (getline(file, line) && !line.empty())
+	if (line.compare(0, 7, "FORMAT=") == 0 && line != "FORMAT=32-bit_rle_rgbe")
+	    return false;
+    // only the usual orientation, rows from the top with pixels left to right
+    getline(file, line);
+    char ysign, yaxis, xsign, xaxis;
+    if (sscanf(line.c_str(), "%c%c %d %c%c %d", &ysign, &yaxis, &height, &xsign, &xaxis, &width) != 6 ||
+	ysign != '-' || yaxis != 'Y' || xsign != '+' || xaxis != 'X' || width <= 0 || height <= 0)
+	return false;
+
+    pixels = std::vector<float3>((long)width*height);
+    std::vector<unsigned char> rgbe(4*width);
+    for (int y = 0; y < height; ++y){
+	unsigned char start[4];
+	if (!file.read((char*)start, 4))
+	    return false;
+	if (width >= 8 && width < 32768 && start[0] == 2 && start[1] == 2 && ((start[2] << 8) | start[3]) == width){
+	    // each component of the line is run length encoded separately
+	    for (int c = 0; c < 4; ++c){
+		for (int x = 0; x < width;){
+		    int count = file.get();
+		    if (count == EOF)
+			return false;
+		    if (count > 128){
+			count -= 128;
+			int value = file.get();
+			if (value == EOF || x + count > width)
+			    return false;
+			for (int i = 0; i < count; ++i)
+			    rgbe[4*x++ + c] = value;
+		    }
+		    else{
+			if (count == 0 || x + count > width)
+			    return false;
+			for (int i = 0; i < count; ++i){
+			    int value = file.get();
+			    if (value == EOF)
+				return false;
+			    rgbe[4*x++ + c] = value;
+			}
+		    }
+		}
+	    }
+	}
+	else{
+	    memcpy(rgbe.data(), start, 4);
+	    if (!file.read((char*)rgbe.data() + 4, 4*(width - 1)))
+		return false;
+	}
+	for (int x = 0; x < width; ++x){
+	    const unsigned char* p = &rgbe[4*x];
+	    float scale = p[3] ? ldexp(1.0f, p[3] - 136) : 0;
+	    pixels[(long)y*width + x] = {p[0]*scale, p[1]*scale, p[2]*scale};
+	}
+    }
+    return true;
+}
+
+// colour (PF) or grey (Pf), rows stored from the bottom. a negative
+// scale means little endian
+static bool load_pfm(std::ifstream& file, int& width, int& height, std::vector<float3>& pixels){
+    std::string magic;
+    float scale;
+    file >> magic >> width >> height >> scale;
+    file.get(); // the single whitespace before the data
+    if ((magic != "PF" && magic != "Pf") || !file || width <= 0 || height <= 0 || scale == 0)
+	return false;
+    const int channels = magic == "PF" ? 3 : 1;
+    uint32_t one = 1;
+    const bool swap = (scale < 0) != (*(unsigned char*)&one == 1);
+
+    std::vector<float> data((long)width*height*channels);
+    if (!file.read((char*)data.data(), data.size()*sizeof(float)))
+	return false;
+    if (swap){
+	for (float& f : data){
+	    unsigned char* b = (unsigned char*)&f;
+	    std::swap(b[0], b[3]);
+	    std::swap(b[1], b[2]);
+	}
+    }
+    pixels = std::vector<float3>((long)width*height);
+    for (int y = 0; y < height; ++y){
+	const float* row = &data[(long)(height - 1 - y)*width*channels];
+	for (int x = 0; x < width; ++x){
+	    const float* p = row + x*channels;
+	    pixels[(long)y*width + x] = channels == 3 ? float3({p[0], p[1], p[2]}) : float3({p[0], p[0], p[0]});
+	}
+    }
+    return true;
+}
+
+bool load_image(std::string filename, int& width, int& height, std::vector<float3>& pixels){
+    std::ifstream file(filename, std::ios::binary);
+    if (!file)
+	return false;
+    std::string extension = filename.substr(filename.rfind(".") + 1);
+    if (extension == "hdr")
+	return load_hdr(file, width, height, pixels);
+    if (extension == "pfm")
+	return load_pfm(file, width, height, pixels);
+    return false;
+}
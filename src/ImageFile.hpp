@@ -0,0 +1,69 @@
+#pragma once
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "float3.h"
+#include "ThreadPool.hpp"
+
+// a named plane of float pixels, one value per pixel in scanline order.
+// names follow the layer.channel convention, e.g. "albedo.R"
+struct ImageChannel{
+    std::string name;
+    std::vector<float> data;
+};
+
+enum ImageFormat{
+    PNG,
+    PPM,
+    PFM,
+    EXR
+};
+
+// picked by the extension of filename, PNG for anything else
+ImageFormat image_format(std::string filename);
+
+// uncompressed scanline OpenEXR holding any number of float channels, so
+// every AOV of a render goes into one file. half stores them as 16 bit
+// floats. returns false if it can't be written
+bool save_exr(std::string filename, int width, int height, std::vector<ImageChannel> channels, bool half = false);
+
+// writes an image in the format its extension picks a band of rows at a
+// time from the top, so only the band has to be in memory. PFM (in the byte
+// order of the host) and EXR are written from float pixels, PNG and PPM from
+// RGBA bytes. the rows of a PNG are filtered and deflated in blocks shared
+// out over pool
+class ImageWriter{
+private:
+    std::ofstream file;
+    const ImageFormat format;
+    const int width;
+    const int height;
+    const bool half;  // EXR as 16 bit floats
+    const bool alpha; // PNG keeps the alpha, otherwise it is dropped
+    ThreadPool& pool;
+    int rows_done;
+    bool failed;
+    long data_start; // PFM, where the rows start. they go from the bottom
+    std::vector<unsigned char> last_row; // PNG, the row above the next band for the filters
+    std::vector<unsigned char> history;  // PNG, the last 32K of filtered bytes for the next band to match
+    unsigned long checksum;              // PNG, Adler-32 of the filtered bytes so far
+    void write_png(const unsigned char* rgba, int rows);
+public:
+    ImageWriter(std::string filename, int width, int height, ThreadPool& pool, bool half = false, bool alpha = false);
+    bool floats() const {return format == PFM || format == EXR;}
+    // the next rows of the image
+    void write(const float3* pixels, int rows);
+    void write(const unsigned char* rgba, int rows);
+    // false if the file couldn't be written or didn't get every row
+    bool finish();
+};
+
+// RGBA8 pixels top row first as a PNG, RGB if they are all opaque. returns
+// false if the file can't be written
+bool save_png(std::string filename, int width, int height, const std::vector<unsigned char>& rgba, ThreadPool& pool);
+
+// radiance (.hdr) or portable float map (.pfm) pixels, top row first.
+// returns false if the file can't be read or isn't one of those
+bool load_image(std::string filename, int& width, int& height, std::vector<float3>& pixels);
@@ -0,0 +1,55 @@
+#include <fstream>
+#include <set>
+#include <sstream>
+#include <string>
+
+#include "error.hpp"
+#include "KernelSource.hpp"
+
+static std::string expand(std::string filename, std::set<std::string>& seen){
+    if (seen.count(filename))
+        return "";
+    seen.insert(filename);
+
+    std::ifstream file(filename);
+    if (!file)
+        print_error("Unable to find file " + filename);
+    std::string dir = filename.substr(0, filename.rfind("/") + 1);
+
+    std::ostringstream out;
+    std::string line;
+    while (getline(file, line)){
+        std::istringstream str(line);
+        std::string directive;
+        str >> directive;
+        if (directive == "#pragma"){
+            std::string what;
+            str >> what;
+            if (what == "once")
+                continue;
+        }
+        if (directive == "#include"){
+            std::string name;
+            str >> name;
+            if (name.size() > 2 && name[0] == '"'){
+                out << expand(dir + name.substr(1, name.size() - 2), seen);
+                continue;
+            }
+        }
+        out << line << "\n";
+    }
+    return out.str();
+}
+
+std::string expand_includes(std::string filename){
+    std::set<std::string> seen;
+    return expand(filename, seen);
+}
+
+unsigned long long hash_string(const std::string& str, unsigned long long hash){
+    for (unsigned char c : str){
+        hash ^= c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
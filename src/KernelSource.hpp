@@ -0,0 +1,10 @@
+#pragma once
+
+#include <string>
+
+// read an OpenCL source file with its quoted #includes pasted in, each file only once.
+// the result builds without any include paths so it can be hashed or embedded.
+std::string expand_includes(std::string filename);
+
+// 64 bit FNV-1a, used to key the program binary cache
+unsigned long long hash_string(const std::string& str, unsigned long long hash = 14695981039346656037ULL);
@@ -0,0 +1,77 @@
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "float3.h"
+#include "Ray.h"
+#include "RaySort.hpp"
+
+const int MORTON_BITS = 9;
+const int KEY_BITS = 3 + 3*MORTON_BITS;
+const int RADIX_BITS = 15;
+const int PASSES = (KEY_BITS + RADIX_BITS - 1)/RADIX_BITS;
+
+// spreads the low ten bits of v out to every third bit
+static uint32_t spread_bits(uint32_t v){
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v << 8)) & 0x0300f00f;
+    v = (v | (v << 4)) & 0x030c30c3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
+
+// origins are quantized to cells of the box, scale is cells per unit
+static uint32_t make_key(const Ray& ray, float3 lo, float3 scale){
+    const float last = (1 << MORTON_BITS) - 1;
+    uint32_t x = std::min(std::max((ray.origin.x - lo.x)*scale.x, 0.0f), last);
+    uint32_t y = std::min(std::max((ray.origin.y - lo.y)*scale.y, 0.0f), last);
+    uint32_t z = std::min(std::max((ray.origin.z - lo.z)*scale.z, 0.0f), last);
+    uint32_t octant = (ray.direction.x < 0) << 2 | (ray.direction.y < 0) << 1 | (ray.direction.z < 0);
+    return octant << 3*MORTON_BITS | spread_bits(x) << 2 | spread_bits(y) << 1 | spread_bits(z);
+}
+
+static float3 cell_scale(float3 lo, float3 hi){
+    const float cells = 1 << MORTON_BITS;
+    return {hi.x > lo.x ? cells/(hi.x - lo.x) : 0,
+	    hi.y > lo.y ? cells/(hi.y - lo.y) : 0,
+	    hi.z > lo.z ? cells/(hi.z - lo.z) : 0};
+}
+
+uint32_t ray_key(const Ray& ray, float3 lo, float3 hi){
+    return make_key(ray, lo, cell_scale(lo, hi));
+}
+
+void sort_rays(const Ray* rays, int count, float3 lo, float3 hi, std::vector<int>& order){
+    const uint32_t digit_mask = (1 << RADIX_BITS) - 1;
+    float3 scale = cell_scale(lo, hi);
+    // key in the high half, index in the low, so a pass moves both at once
+    std::vector<uint64_t> items(count);
+    std::vector<uint64_t> sorted(count);
+    // the counts of every digit are gathered in a single read of the keys
+    std::vector<int> offsets(PASSES << RADIX_BITS, 0);
+    for (int i = 0; i < count; ++i){
+	uint32_t key = make_key(rays[i], lo, scale);
+	items[i] = (uint64_t)key << 32 | (uint32_t)i;
+	for (int p = 0; p < PASSES; ++p)
+	    offsets[p << RADIX_BITS | ((key >> p*RADIX_BITS) & digit_mask)]++;
+    }
+
+    // least significant digit first, each pass keeps the order of the last
+    for (int p = 0; p < PASSES; ++p){
+	int* offset = &offsets[p << RADIX_BITS];
+	int total = 0;
+	for (int d = 0; d <= (int)digit_mask; ++d){
+	    int n = offset[d];
+	    offset[d] = total;
+	    total += n;
+	}
+	int shift = 32 + p*RADIX_BITS;
+	for (int i = 0; i < count; ++i)
+	    sorted[offset[(items[i] >> shift) & digit_mask]++] = items[i];
+	items.swap(sorted);
+    }
+
+    order.resize(count);
+    for (int i = 0; i < count; ++i)
+	order[i] = (int)items[i];
+}
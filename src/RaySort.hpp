@@ -0,0 +1,20 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "float3.h"
+#include "Ray.h"
+
+// reorders a batch of rays so that ones which start close together and head
+// the same way are traced one after another and share the nodes they fetch.
+// after the first bounce the rays of neighbouring pixels scatter, this gets
+// back some of the coherence camera rays have.
+
+// the octant of the direction in the top three bits, then the morton code of
+// the origin within the box lo, hi with nine bits per axis
+uint32_t ray_key(const Ray& ray, float3 lo, float3 hi);
+
+// order[i] is the index of the ray to trace i-th. a stable radix sort, so rays
+// with the same key keep their order.
+void sort_rays(const Ray* rays, int count, float3 lo, float3 hi, std::vector<int>& order);
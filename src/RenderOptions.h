@@ -0,0 +1,34 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+struct RenderOptions{
+    std::string output_file = "test.png"; // png, ppm, pfm or exr, picked by the extension
+    bool half = false;       // store an EXR output image as 16 bit floats
+    bool stream = false;     // render and write the image a band of rows at a time rather than holding all of it
+    int width = 512;
+    int height = 384;
+    int samples = 100;       // 0 for no limit, only allowed with a time limit
+    int bloom_rad = 1;
+    int max_bounces = 10;
+    float target_error = 0;  // relative error at which a pixel stops sampling, 0 to disable
+    int tile_size = 0;       // side of the square tiles to render, 0 for the whole image at once
+    double time_limit = 0;   // seconds to render for, 0 to render all samples
+    std::string sample_map;  // where to save the per-pixel sample counts, empty to disable
+    std::string preview_file; // where to save previews while rendering, empty to disable
+    double preview_interval = 10; // seconds between previews
+    std::vector<int> snapshots; // samples per pixel to save a copy of the image at on the way, ascending
+    double snapshot_interval = 0; // seconds between copies of the image saved on the way, 0 to disable
+    std::string checkpoint_file; // where to save the state of the render now and then, empty to disable
+    double checkpoint_interval = 300; // seconds between checkpoints
+    bool resume = false;     // carry on from the checkpoint file
+    int first_sample = 0;    // index of the first sample each pixel takes, to render a range of them
+    std::string accumulate_file; // where to save the unnormalized sums for merge instead of an image, empty to disable
+    std::string backend = "opencl"; // opencl or cpu
+    int threads = 0;         // worker threads for the host side, 0 for one per core
+    bool denoise = false;    // filter the image guided by what the camera rays hit
+    std::string aov_file;    // where to save depth, normal, albedo, lighting and more as EXR layers, empty to disable
+    std::string tonemap = "gamma"; // gamma, srgb, reinhard or aces
+    std::string cache_dir = ".kernel_cache"; // where to keep compiled programs, empty to disable
+};
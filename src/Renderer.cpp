@@ -1,181 +1,418 @@
+#include <algorithm>
 #include <chrono>
+#include <cstdio>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
-#include <random>
-#include <streambuf>
+#include <sstream>
 #include <string>
 #include <vector>
 
-#include <CL/cl.hpp>
+#include <climits>
+#include <cmath>
+#include <csignal>
 
+#include "Bloom.hpp"
 #include "Camera.h"
+#include "Denoiser.hpp"
 #include "error.hpp"
+#include "Features.h"
 #include "float3.h"
-#include "lodepng.h"
+#include "ImageFile.hpp"
 #include "Renderer.hpp"
-#include "Scene.hpp"
-#include "Triangle.h"
-
-inline float clamp(float x){return x<0.0? 0.0: x>1.0 ? 1.0 : x;}
-inline int to_int(float x){return int(pow(clamp(x), 1/2.2)*255 + 0.5);}
-
-void Renderer::get_platform(){
-    std::vector<cl::Platform> all_platforms;
-    cl::Platform::get(&all_platforms);
-    if (all_platforms.size() == 0)
-        print_error("No platform found. Check OpenCL installation.");
-    platform = all_platforms[0];
-
-    std::clog << "  Using platform: " << platform.getInfo<CL_PLATFORM_NAME>() << std::endl;
-}
-
-void Renderer::get_device(){
-    std::vector<cl::Device> all_devices;
-    platform.getDevices(CL_DEVICE_TYPE_GPU, &all_devices);
-    if (all_devices.size() == 0){
-	platform.getDevices(CL_DEVICE_TYPE_ALL, &all_devices);
-	if (all_devices.size() == 0)
-	    print_error("No devices found. Check OpenCL installation.");
-	else
-	    print_warning("Using non-GPU device. GPU recommended.");
-    }
-    device = all_devices[0];
-
-    std::clog << "  Using device: " << device.getInfo<CL_DEVICE_NAME>() << std::endl;
-}
-
-void Renderer::create_from_file_and_build(std::string kernel_filename){
-    std::ifstream stream(kernel_filename);
-    std::string source((std::istreambuf_iterator<char>(stream)), std::istreambuf_iterator<char>());
-    cl::Program::Sources sources;
-    sources.push_back({source.c_str(), source.length()});
-    program = cl::Program(context, sources);
-    std::string flags = "-I src";
-    int result = program.build({device}, flags.c_str());
-    if (result != CL_SUCCESS){
-        if (result == CL_OUT_OF_HOST_MEMORY)
-            std::cout << "out pf host memory"<<std::endl;
-	print_error(program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device));
-    }
-    else
-	std::clog << "  Sucessfully built program." << std::endl;
-    queue = cl::CommandQueue(context, device);
+#include "RenderOptions.h"
+#include "Tonemap.hpp"
+
+Renderer::Renderer(const RenderOptions& opts) :
+    pool(opts.threads), snapshot_pool(1), width(opts.width), height(opts.height), samples(opts.samples), bloom_rad(opts.bloom_rad), options(opts), tonemapper(opts.tonemap),
+    keep_features(opts.denoise || !opts.aov_file.empty()), keep_aovs(!opts.aov_file.empty()){
+    take_snapshots = !opts.snapshots.empty() || opts.snapshot_interval > 0;
+    next_snapshot_time = opts.snapshot_interval;
+    take_checkpoints = !opts.checkpoint_file.empty();
 }
 
-Renderer::Renderer(std::string kernel_filename, int w, int h, int s, int r) : width(w), height(h), samples(s), bloom_rad(r){
-    std::clog << "Initializing OpenCL..." << std::endl;
-    get_platform();
-    get_device();
-    context = cl::Context({device});
-    create_from_file_and_build(kernel_filename);
+RayGen Renderer::prepare_camera(const Camera& cam){
+    RayGen gen;
+    //camera space unit basis vectors
+    gen.w = normalize(cam.location - cam.looking_at);
+    gen.u = cross({0,1,0}, gen.w);
+    gen.v = cross(gen.w, gen.u);
+    gen.origin = cam.location;
+    gen.lens_radius = cam.type == PERSPECTIVE ? cam.lens_radius : 0;
+    gen.type = cam.type;
+
+    // the screen sits on the plane in focus
+    float focal_length = cam.focus_distance > 0 ? cam.focus_distance : length(cam.location - cam.looking_at);
+    float screen_height = tan(cam.aperture/2);
+    float screen_width = screen_height*width/height;
+
+    gen.screen_corner = cam.location - screen_width*focal_length*gen.u - screen_height*focal_length*gen.v - focal_length*gen.w;
+    gen.horiz = 2*screen_width*focal_length*gen.u;
+    gen.vert = 2*screen_height*focal_length*gen.v;
+    if (cam.type == ORTHOGRAPHIC) // same view as the screen, but rays start on the camera plane
+	gen.screen_corner = gen.screen_corner + focal_length*gen.w;
+    return gen;
 }
 
-void Renderer::bloom(){
-    float stddev = 5.0/512*width;
-    float kernel[(2*bloom_rad+1)*(2*bloom_rad+1)];
-    float denom = 2*stddev*stddev;
-    for (int y = -bloom_rad; y<=bloom_rad; y++){
-	for (int x = -bloom_rad; x<=bloom_rad; x++){
-	    kernel[(y+bloom_rad)*(2*bloom_rad+1)+x+bloom_rad] = exp(-(x*x+y*y)/denom)/denom/M_PI;
-	}
-    }
-    std::vector<float3> temp(width*height);
-    for (int i = 0; i<width*height; i++){
-	float r,g,b;
-	r=g=b=0;
-	if (output[i].x > 1) r = output[i].x - 1;
-	if (output[i].y > 1) g = output[i].y - 1;
-	if (output[i].z > 1) b = output[i].z - 1;
-        temp[i] = {r,g,b};
-    }
-    for (int y = 0; y<height; y++){
-	for(int x = 0; x<width; x++){
-	    float3 c = {0,0,0};
-	    for (int ky = -bloom_rad; ky<=bloom_rad; ky++){
-		for (int kx = -bloom_rad; kx<=bloom_rad; kx++){
-		    if ((y+ky)>=0 && (y+ky)<height &&
-			(x+kx)>=0 && (x+kx)<width){
-			c = c+kernel[(ky+bloom_rad)*(2*bloom_rad+1)+kx+bloom_rad]*temp[(y+ky)*width+(x+kx)];
-		    }
-		}
+void Renderer::print_progress(){
+    std::chrono::duration<double> elapsed = std::chrono::system_clock::now() - render_start;
+    double percent = std::min((double)paths_done/budget, 1.0);
+    if (options.time_limit > 0)
+	percent = std::max(percent, std::min(elapsed.count()/options.time_limit, 1.0));
+    double seconds = elapsed.count()*(1/percent - 1);
+    int minutes = seconds/60;
+    int hours = minutes/60;
+    seconds -= 60*minutes;
+    minutes -= 60*hours;
+    std::streamsize ss = std::clog.precision();
+    std::clog << "Progress: " << std::fixed << std::setprecision(1) << 100*percent << "% Time remaining: " << hours << "h" << minutes << "m" << seconds << "s                     \r" << std::flush;
+    std::clog.unsetf(std::ios::fixed);
+    std::clog.precision(ss);
+}
+
+void Renderer::copy_tile(const Tile& tile, const float3* tile_out, const cl_uint* tile_counts,
+			 const Features* tile_features, const AOVs* tile_aovs){
+    for (int y = 0; y < tile.height; ++y){
+	for (int x = 0; x < tile.width; ++x){
+	    int i = (tile.y - band_y + y)*width + tile.x + x;
+	    int j = y*tile.width + x;
+	    counts[i] = tile_counts[j];
+	    float scale = counts[i] ? 1.0f/counts[i] : 0;
+	    output[i] = scale*tile_out[j];
+	    if (tile_features){
+		features[i].albedo = scale*tile_features[j].albedo;
+		features[i].normal = scale*tile_features[j].normal;
+		features[i].depth = scale*tile_features[j].depth;
+	    }
+	    if (tile_aovs){
+		aovs[i].direct = scale*tile_aovs[j].direct;
+		aovs[i].material = tile_aovs[j].material;
 	    }
-	    output[y*width+x] = (1.0f/20)*c + output[y*width + x];
 	}
     }
 }
 
-void Renderer::render(Scene& scene){
-    output = std::vector<float3>(width*height);
-    std::vector<cl_uint2> seeds = std::vector<cl_uint2>(width*height);
-    std::default_random_engine rand_gen;
-    for (int i = 0; i< seeds.size(); ++i){
-	seeds[i].x = rand_gen();
-	seeds[i].y = rand_gen();
+cl_uint Renderer::sample_cap() const{
+    return samples <= 0 ? UINT_MAX : options.target_error > 0 ? 16*samples : samples;
+}
+
+cl_uint Renderer::lowest_active_count(const cl_uint* sample_counts, const cl_uchar* active, long pixels){
+    cl_uint lowest = UINT_MAX;
+    for (long i = 0; i < pixels; ++i)
+	if (active[i])
+	    lowest = std::min(lowest, sample_counts[i]);
+    return lowest;
+}
+
+void Renderer::save_sample_map(std::string filename){
+    cl_uint max_count = 1;
+    for (int i = 0; i < width*height; ++i)
+	max_count = std::max(max_count, counts[i]);
+    if (max_count > sample_cap())
+	print_warning("A pixel took " + std::to_string(max_count) + " samples, over the cap of " + std::to_string(sample_cap()));
+
+    std::vector<unsigned char> image = std::vector<unsigned char>(width*height*4);
+    for (int i = 0; i < width*height; ++i){
+	unsigned char c = (unsigned char)(255.0*counts[i]/max_count + 0.5);
+	image[4*i + 0] = c;
+	image[4*i + 1] = c;
+	image[4*i + 2] = c;
+	image[4*i + 3] = 255;
     }
 
-    cl::Buffer out_buf(context, CL_MEM_READ_WRITE, sizeof(float3)*width*height);
-    cl::Buffer bvh_buf(context, CL_MEM_READ_WRITE, sizeof(GPU_BVHnode)*scene.bvh.GPU_BVH.size());
-    cl::Buffer triangle_buf(context, CL_MEM_READ_WRITE, sizeof(Triangle)*scene.bvh.ordered.size());
-    cl::Buffer material_buf(context, CL_MEM_READ_WRITE, sizeof(Material)*scene.materials.size());
-    cl::Buffer seed_buf(context, CL_MEM_READ_WRITE, sizeof(cl_uint2)*width*height);
+    std::clog << "  Saving sample map (max " << max_count << " samples) to " << filename << std::endl;
+    if (!save_png(filename, width, height, image, pool))
+	print_warning("Unable to save sample map to " + filename);
+}
+
+std::vector<unsigned char> Renderer::to_rgba(){
+    std::vector<unsigned char> image;
+    tonemapper.apply(output, image, pool);
+    return image;
+}
+
+std::string Renderer::snapshot_file(std::string label){
+    const std::string& file = options.output_file;
+    size_t dot = file.rfind(".");
+    size_t slash = file.rfind("/");
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+	dot = file.size();
+    return file.substr(0, dot) + "_" + label + file.substr(dot);
+}
+
+// sample counts are checked first, a snapshot that is due on time waits for
+// the next check
+std::string Renderer::due_snapshot(long paths){
+    if (!take_snapshots)
+	return "";
+    const long pixels = (long)width*height;
+    std::string label;
+    while (next_snapshot < options.snapshots.size() && paths >= options.snapshots[next_snapshot]*pixels)
+	label = std::to_string(options.snapshots[next_snapshot++]) + "spp";
+    if (!label.empty() || options.snapshot_interval <= 0)
+	return label;
+    double elapsed = std::chrono::duration<double>(std::chrono::system_clock::now() - render_start).count();
+    if (elapsed < next_snapshot_time)
+	return "";
+    std::ostringstream time;
+    time << next_snapshot_time << "s";
+    while (next_snapshot_time <= elapsed)
+	next_snapshot_time += options.snapshot_interval;
+    return time.str();
+}
 
-    queue.enqueueWriteBuffer(out_buf, CL_TRUE, 0, output.size()*sizeof(float3), output.data());
-    queue.enqueueWriteBuffer(seed_buf, CL_TRUE, 0, seeds.size()*sizeof(cl_uint2), seeds.data());
-    queue.enqueueWriteBuffer(bvh_buf, CL_TRUE, 0, sizeof(GPU_BVHnode)*scene.bvh.GPU_BVH.size(),
-			     scene.bvh.GPU_BVH.data());
-    queue.enqueueWriteBuffer(triangle_buf, CL_TRUE, 0, sizeof(Triangle)*scene.bvh.ordered.size(),
-			     scene.bvh.ordered.data());
-    queue.enqueueWriteBuffer(material_buf, CL_TRUE, 0, sizeof(Material)*scene.materials.size(),
-			     scene.materials.data());
+long Renderer::snapshot_paths(){
+    if (!take_snapshots || next_snapshot >= options.snapshots.size())
+	return LONG_MAX;
+    return options.snapshots[next_snapshot]*(long)width*height;
+}
 
-    cl::Kernel kernel = cl::Kernel(program, "render");
-    cl::make_kernel<cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer, Camera, int> render_kernel(kernel);
-    cl::EnqueueArgs eargs(queue, cl::NullRange, cl::NDRange(width,height), cl::NDRange(8,8));
+// only one snapshot is finished at a time, the next waits for the last to
+// be written before it takes the buffer
+void Renderer::save_snapshot(const float3* sums, const cl_uint* sample_counts, std::string label){
+    finish_snapshots();
+    const long pixels = (long)width*height;
+    snapshot_image.resize(pixels);
+    for (long i = 0; i < pixels; ++i)
+	snapshot_image[i] = sample_counts[i] ? (1.0f/sample_counts[i])*sums[i] : float3({0,0,0});
+    std::string filename = snapshot_file(label);
+    std::clog << "Snapshot at " << label << " to " << filename << "                    " << std::endl;
+    snapshot_thread = std::thread([this, filename](){
+	bloom(snapshot_image, width, height, bloom_rad, snapshot_pool);
+	ImageWriter snapshot_writer(filename, width, height, snapshot_pool, options.half);
+	if (snapshot_writer.floats())
+	    snapshot_writer.write(snapshot_image.data(), height);
+	else{
+	    std::vector<unsigned char> rgba;
+	    tonemapper.apply(snapshot_image, rgba, snapshot_pool);
+	    snapshot_writer.write(rgba.data(), height);
+	}
+	if (!snapshot_writer.finish())
+	    print_warning("Unable to save snapshot to " + filename);
+    });
+}
 
-    std::clog << "Starting render..." << std::endl;
+void Renderer::finish_snapshots(){
+    if (snapshot_thread.joinable())
+	snapshot_thread.join();
+}
 
-    int samples_done = 0;
+static volatile std::sig_atomic_t stop_signal = 0;
 
-    std::streamsize ss = std::clog.precision();
-    std::chrono::time_point<std::chrono::system_clock> start = std::chrono::system_clock::now();
-    while(samples_done+32 < samples){
-	render_kernel(eargs, out_buf, seed_buf, bvh_buf, triangle_buf, material_buf, scene.camera, 32).wait();
-	samples_done+=32;
-	double percent = (double)samples_done/samples;
-	std::chrono::duration<double> time = std::chrono::system_clock::now() - start;
-	double seconds = time.count()*(1/percent - 1);
-	int minutes = seconds/60;
-	int hours = minutes/60;
-	seconds -= 60*minutes;
-	minutes -= 60*hours;
-	std::clog << "Progress: " << std::fixed << std::setprecision(1) << 100*percent << "% Time remaining: " << hours << "h" << minutes << "m" << seconds << "s                     \r" << std::flush;
+// a second signal stops the process as usual
+static void catch_stop(int sig){
+    stop_signal = sig;
+    std::signal(sig, SIG_DFL);
+}
+
+void Renderer::start_checkpoints(const Scene& scene){
+    if (!take_checkpoints)
+	return;
+    scene_hash = scene.hash();
+    last_checkpoint = std::chrono::system_clock::now();
+    std::signal(SIGINT, catch_stop);
+    std::signal(SIGTERM, catch_stop);
+}
+
+bool Renderer::checkpoint_due(){
+    if (!take_checkpoints)
+	return false;
+    std::chrono::duration<double> since = std::chrono::system_clock::now() - last_checkpoint;
+    return stop_signal || since.count() >= options.checkpoint_interval;
+}
+
+// the header says what the sums are of, the arrays are as they are in memory.
+// written to a temporary file first so a kill while writing leaves the last one
+void Renderer::save_checkpoint(const float3* sums, const float* sq, const cl_uint* sample_counts, const cl_uchar* active,
+			       const Features* feature_sums, const AOVs* aov_sums){
+    const long pixels = (long)width*height;
+    const std::string temp = options.checkpoint_file + ".tmp";
+    std::ofstream file(temp, std::ios::binary);
+    auto put = [&](const void* data, size_t size){
+	file.write((const char*)data, size);
+    };
+    const int32_t settings[5] = {width, height, options.max_bounces, keep_features, keep_aovs};
+    const int64_t paths = paths_done;
+    const double seconds = std::chrono::duration<double>(std::chrono::system_clock::now() - render_start).count();
+    put("RTCHECK1", 8);
+    put(&scene_hash, sizeof(scene_hash));
+    put(settings, sizeof(settings));
+    put(&paths, sizeof(paths));
+    put(&seconds, sizeof(seconds));
+    put(sums, pixels*sizeof(float3));
+    put(sq, pixels*sizeof(float));
+    put(sample_counts, pixels*sizeof(cl_uint));
+    put(active, pixels*sizeof(cl_uchar));
+    if (keep_features)
+	put(feature_sums, pixels*sizeof(Features));
+    if (keep_aovs)
+	put(aov_sums, pixels*sizeof(AOVs));
+    file.close();
+    if (!file || std::rename(temp.c_str(), options.checkpoint_file.c_str()) != 0)
+	print_warning("Unable to save checkpoint to " + options.checkpoint_file);
+    else
+	std::clog << "Checkpoint at " << (double)paths_done/pixels << " samples per pixel saved to " << options.checkpoint_file
+		  << "                    " << std::endl;
+    last_checkpoint = std::chrono::system_clock::now();
+    stopped = stop_signal != 0;
+}
+
+bool Renderer::load_checkpoint(float3* sums, float* sq, cl_uint* sample_counts, cl_uchar* active,
+			       Features* feature_sums, AOVs* aov_sums){
+    const long pixels = (long)width*height;
+    std::ifstream file(options.checkpoint_file, std::ios::binary);
+    if (!file){
+	print_warning("No checkpoint at " + options.checkpoint_file + ", starting from the beginning");
+	return false;
     }
-    std::clog.unsetf(std::ios::fixed);
-    std::clog.precision(ss);
-    std::clog << "Progress:  100% Time remaining: 0h0m0.0s      " << std::endl;
-    if (samples_done < samples)
-	render_kernel(eargs, out_buf, seed_buf, bvh_buf, triangle_buf, material_buf, scene.camera, samples - samples_done).wait();
+    auto get = [&](void* data, size_t size){
+	file.read((char*)data, size);
+    };
+    char magic[8];
+    uint64_t hash;
+    int32_t settings[5];
+    const int32_t expected[5] = {width, height, options.max_bounces, keep_features, keep_aovs};
+    int64_t paths;
+    double seconds;
+    get(magic, 8);
+    get(&hash, sizeof(hash));
+    get(settings, sizeof(settings));
+    get(&paths, sizeof(paths));
+    get(&seconds, sizeof(seconds));
+    if (!file || std::string(magic, 8) != "RTCHECK1")
+	print_error(options.checkpoint_file + " isn't a checkpoint");
+    if (hash != scene_hash || !std::equal(settings, settings + 5, expected))
+	print_error("Checkpoint " + options.checkpoint_file + " is of another scene, size, bounce limit, --denoise or --aov");
+    get(sums, pixels*sizeof(float3));
+    get(sq, pixels*sizeof(float));
+    get(sample_counts, pixels*sizeof(cl_uint));
+    get(active, pixels*sizeof(cl_uchar));
+    if (keep_features)
+	get(feature_sums, pixels*sizeof(Features));
+    if (keep_aovs)
+	get(aov_sums, pixels*sizeof(AOVs));
+    if (!file)
+	print_error("Checkpoint " + options.checkpoint_file + " is cut short");
 
-    queue.enqueueReadBuffer(out_buf, CL_TRUE, 0, sizeof(float3)*width*height, output.data());
+    paths_done = paths;
+    render_start -= std::chrono::duration_cast<std::chrono::system_clock::duration>(std::chrono::duration<double>(seconds));
+    first_sample = std::chrono::system_clock::now();
+    // the snapshots before the checkpoint were taken before it
+    due_snapshot(paths_done);
+    std::clog << "Resuming from " << options.checkpoint_file << " at " << (double)paths_done/pixels << " samples per pixel" << std::endl;
+    return true;
+}
 
-    for (int i = 0; i< output.size(); ++i){
-	output[i] = (1.0)/samples * output[i];
+// the image as rendered, before denoising and bloom, with a layer for every
+// AOV. direct and indirect light add up to the image.
+void Renderer::save_aovs(std::string filename){
+    const long pixels = (long)width*height;
+    const char* rgb[3] = {"R", "G", "B"};
+    const char* xyz[3] = {"X", "Y", "Z"};
+    std::vector<ImageChannel> channels;
+    auto add = [&](std::string name){
+	channels.push_back({name, std::vector<float>(pixels)});
+	return channels.back().data.data();
+    };
+    for (int c = 0; c < 3; ++c){
+	float* image = add(rgb[c]);
+	float* albedo = add(std::string("albedo.") + rgb[c]);
+	float* normal = add(std::string("normal.") + xyz[c]);
+	float* direct = add(std::string("direct.") + rgb[c]);
+	float* indirect = add(std::string("indirect.") + rgb[c]);
+	for (long i = 0; i < pixels; ++i){
+	    image[i] = output[i].s[c];
+	    albedo[i] = features[i].albedo.s[c];
+	    normal[i] = features[i].normal.s[c];
+	    direct[i] = aovs[i].direct.s[c];
+	    indirect[i] = output[i].s[c] - aovs[i].direct.s[c];
+	}
     }
+    float* depth = add("depth.Z");
+    float* material = add("material.ID");
+    float* sample_count = add("samples.Y");
+    for (long i = 0; i < pixels; ++i){
+	depth[i] = features[i].depth;
+	material[i] = aovs[i].material;
+	sample_count[i] = counts[i];
+    }
+
+    std::clog << "  Saving AOVs to " << filename << std::endl;
+    if (!save_exr(filename, width, height, channels))
+	print_warning("Unable to save AOVs to " + filename);
+}
+
+// what has been rendered so far, without bloom
+void Renderer::save_preview(){
+    save_png(options.preview_file, width, height, to_rgba(), pool);
+}
+
+void Renderer::start_stream(){
+    band_y = 0;
+    bloom_stream.reset(new BloomStream(width, height, bloom_rad, pool));
+    writer.reset(new ImageWriter(options.output_file, width, height, pool, options.half));
+}
+
+// bloom holds back the rows within its radius of the bottom of the band
+// until the next one is in
+void Renderer::stream_band(int rows){
+    std::vector<float3> done;
+    bloom_stream->add(output.data(), rows, done);
+    const int finished = done.size()/width;
+    std::vector<unsigned char> rgba;
+    if (!writer->floats())
+	tonemapper.apply(done, rgba, pool);
+    std::chrono::time_point<std::chrono::system_clock> start = std::chrono::system_clock::now();
+    if (writer->floats())
+	writer->write(done.data(), finished);
+    else
+	writer->write(rgba.data(), finished);
+    encode_time += std::chrono::duration<double>(std::chrono::system_clock::now() - start).count();
+    band_y += rows;
+}
+
+void Renderer::save_accumulation(std::string filename){
+    print_error("Accumulation files can only be saved by the cpu backend");
 }
 
 void Renderer::save_image(std::string filename){
-    std::clog << "Saving image ..." << std::endl;
+    // every band has already been written
+    if (options.stream){
+	if (!writer->finish())
+	    print_warning("Unable to save image to " + filename);
+	return;
+    }
 
-    bloom();
+    if (keep_aovs)
+	save_aovs(options.aov_file);
 
-    std::vector<unsigned char> image = std::vector<unsigned char>(width*height*4);
-    for (int i = 0; i < width*height; ++i){
-	image[4*i + 0] = to_int(output[i].x);
-	image[4*i + 1] = to_int(output[i].y);
-	image[4*i + 2] = to_int(output[i].z);
-	image[4*i + 3] = 255;
+    if (options.denoise){
+	std::chrono::time_point<std::chrono::system_clock> start = std::chrono::system_clock::now();
+	denoise(output, features, width, height, pool);
+	std::chrono::duration<double> elapsed = std::chrono::system_clock::now() - start;
+	std::clog << "Denoised in " << elapsed.count() << "s" << std::endl;
     }
 
-    lodepng::encode(filename, image, width, height);
+    std::clog << "Saving image ..." << std::endl;
+
+    // float formats get the bloomed linear image, the others the tonemapped bytes
+    ImageWriter image_writer(filename, width, height, pool, options.half);
+    std::vector<unsigned char> image;
+    if (image_writer.floats() || !device_image(image)){
+	bloom(output, width, height, bloom_rad, pool);
+	if (!image_writer.floats())
+	    image = to_rgba();
+    }
+
+    std::chrono::time_point<std::chrono::system_clock> start = std::chrono::system_clock::now();
+    if (image_writer.floats())
+	image_writer.write(output.data(), height);
+    else
+	image_writer.write(image.data(), height);
+    if (!image_writer.finish())
+	print_warning("Unable to save image to " + filename);
+    encode_time = std::chrono::duration<double>(std::chrono::system_clock::now() - start).count();
+
+    if (!options.sample_map.empty())
+	save_sample_map(options.sample_map);
 }
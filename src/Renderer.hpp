@@ -1,30 +1,116 @@
 #pragma once
+#include <chrono>
+#include <cstdint>
+#include <memory>
 #include <string>
+#include <thread>
 #include <vector>
 
-#include <CL/cl.hpp>
-
+#include "Bloom.hpp"
+#include "Camera.h"
+#include "Features.h"
 #include "float3.h"
+#include "ImageFile.hpp"
+#include "RenderOptions.h"
 #include "Scene.hpp"
+#include "ThreadPool.hpp"
+#include "Tonemap.hpp"
+
+struct Tile{
+    int x, y; // top left corner in the output image
+    int width, height;
+};
+
+const int STREAM_ROWS = 256; // rows in a band of streamed output, rounded up to whole tiles
 
+// what every backend shares: the image being accumulated, progress
+// reporting and everything done to the image after rendering
 class Renderer{
-private:
-    void get_platform();
-    void get_device();
-    void create_from_file_and_build(std::string kernel_filename);
-    void bloom();
+protected:
+    void save_sample_map(std::string filename);
+    // the most samples a pixel takes, 16 times -p with adaptive sampling
+    cl_uint sample_cap() const;
+    // the fewest samples an active pixel has taken, UINT_MAX when none is active
+    static cl_uint lowest_active_count(const cl_uint* sample_counts, const cl_uchar* active, long pixels);
+    // tile_features and tile_aovs are only given when they are being kept
+    void copy_tile(const Tile& tile, const float3* tile_out, const cl_uint* tile_counts,
+		   const Features* tile_features = NULL, const AOVs* tile_aovs = NULL);
+    void save_aovs(std::string filename);
+    void save_preview();
+    // opens the output file before rendering so bands can go out as they finish
+    void start_stream();
+    // bloom, tonemap and write what the band of rows in output finishes, then
+    // move on to the band below it
+    void stream_band(int rows);
+    // the output file name with label added before the extension
+    std::string snapshot_file(std::string label);
+    // the label of the snapshot due once the image has taken paths, empty
+    // when none is. it counts as taken from then on
+    std::string due_snapshot(long paths);
+    // how many paths the image can take before the next sample count snapshot
+    long snapshot_paths();
+    // copies out the image from its sums and counts, then blooms, tonemaps
+    // and saves it on a thread of its own while rendering goes on
+    void save_snapshot(const float3* sums, const cl_uint* sample_counts, std::string label);
+    void finish_snapshots();
+    // checkpoints hold the sums of the whole image, so a render that was
+    // stopped can carry on from them with --resume. the random numbers of a
+    // sample only depend on the pixel and its count, so they carry on too
+    void start_checkpoints(const Scene& scene);
+    // when the interval is up, or a signal asked to stop
+    bool checkpoint_due();
+    // after a signal, sets stopped
+    void save_checkpoint(const float3* sums, const float* sq, const cl_uint* sample_counts, const cl_uchar* active,
+			 const Features* feature_sums, const AOVs* aov_sums);
+    // restores paths_done and the time spent, false without a checkpoint to resume from
+    bool load_checkpoint(float3* sums, float* sq, cl_uint* sample_counts, cl_uchar* active,
+			 Features* feature_sums, AOVs* aov_sums);
+    std::vector<unsigned char> to_rgba();
+    // the finished image, bloomed and packed to RGBA8 where the backend still
+    // has it. false to have it done on the host from output instead
+    virtual bool device_image(std::vector<unsigned char>& rgba){return false;}
+    void print_progress();
+    RayGen prepare_camera(const Camera& cam);
+    // with options.stream, output and counts only hold the band of rows from band_y
+    int band_y = 0;
+    std::unique_ptr<BloomStream> bloom_stream;
+    std::unique_ptr<ImageWriter> writer;
     std::vector<float3> output;
-    cl::Platform platform;
-    cl::Device device;
-    cl::Context context;
-    cl::Program program;
-    cl::CommandQueue queue;
+    std::vector<cl_uint> counts;
+    std::vector<Features> features; // mean first hit of each pixel, only when keep_features
+    std::vector<AOVs> aovs;         // mean direct light and first material of each pixel, only when keep_aovs
+    ThreadPool pool;
+    ThreadPool snapshot_pool; // a thread to finish snapshots with
+    bool take_snapshots;
+    size_t next_snapshot = 0;
+    double next_snapshot_time;
+    std::vector<float3> snapshot_image;
+    std::thread snapshot_thread;
+    bool take_checkpoints;
+    uint64_t scene_hash;
+    std::chrono::time_point<std::chrono::system_clock> last_checkpoint;
+    std::chrono::time_point<std::chrono::system_clock> render_start;
+    long budget;
+    long paths_done;
+    long converged;
     const int width;
     const int height;
     const int samples;
     const int bloom_rad;
+    const RenderOptions options;
+    const Tonemapper tonemapper;
+    const bool keep_features; // for the denoiser or the AOVs
+    const bool keep_aovs;
 public:
-    Renderer(std::string kernel_filename, int width, int height, int samples, int radius);
-    void render(Scene& scene);
+    std::chrono::time_point<std::chrono::system_clock> first_sample; // when the first samples were finished
+    double encode_time = 0; // seconds spent writing the image file
+    bool stopped = false; // by a signal, there's only a checkpoint to show for it
+    Renderer(const RenderOptions& options);
+    virtual ~Renderer(){finish_snapshots();}
+    virtual void build(const Scene& scene){} // get ready for a scene before its BVH is built
+    virtual void render(Scene& scene) = 0;
     void save_image(std::string filename);
+    // the unnormalized sums of the samples taken, for bin/merge. only the
+    // backends that keep them in fixed point can
+    virtual void save_accumulation(std::string filename);
 };
@@ -0,0 +1,479 @@
+#include <algorithm>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define X86_SIMD
+#endif
+
+#include "float3.h"
+#include "SIMDIntersect.hpp"
+
+// every level does the same arithmetic in the same order as intersect() in
+// render_kernel.cl, one lane per box or triangle
+
+static int boxes_scalar(const WideNode& node, const RayData& ray, float t, float* dist){
+    int hits = 0;
+    for (int k = 0; k < WIDTH; ++k){
+	float tx0 = (node.min_x[k] - ray.origin.x)*ray.inv_direction.x;
+	float tx1 = (node.max_x[k] - ray.origin.x)*ray.inv_direction.x;
+	float ty0 = (node.min_y[k] - ray.origin.y)*ray.inv_direction.y;
+	float ty1 = (node.max_y[k] - ray.origin.y)*ray.inv_direction.y;
+	float tz0 = (node.min_z[k] - ray.origin.z)*ray.inv_direction.z;
+	float tz1 = (node.max_z[k] - ray.origin.z)*ray.inv_direction.z;
+	float near = std::max(std::max(std::min(tx0, tx1), std::min(ty0, ty1)), std::max(std::min(tz0, tz1), 0.0f));
+	float far = std::min(std::min(std::max(tx0, tx1), std::max(ty0, ty1)), std::max(tz0, tz1));
+	dist[k] = near;
+	if (near <= far && near < t)
+	    hits |= 1 << k;
+    }
+    return hits;
+}
+
+static void triangles_scalar(const TriangleBlock* blocks, int count, const RayData& ray, float& t, int& id){
+    for (int b = 0; b < count; ++b){
+	const TriangleBlock& block = blocks[b];
+	for (int k = 0; k < WIDTH; ++k){
+	    float3 e1 = {block.e1_x[k], block.e1_y[k], block.e1_z[k]};
+	    float3 e2 = {block.e2_x[k], block.e2_y[k], block.e2_z[k]};
+	    float3 tvec = ray.origin - float3({block.v0_x[k], block.v0_y[k], block.v0_z[k]});
+	    float3 pvec = cross(ray.direction, e2);
+	    float det = 1.0f/dot(e1, pvec);
+	    float u = dot(tvec, pvec)*det;
+	    if (!(u >= 0 && u <= 1))
+		continue;
+	    float3 qvec = cross(tvec, e1);
+	    float v = dot(ray.direction, qvec)*det;
+	    if (!(v >= 0 && u + v <= 1))
+		continue;
+	    float d = dot(e2, qvec)*det;
+	    if (d > 0.000001f && d < t){
+		t = d;
+		id = block.id[k];
+	    }
+	}
+    }
+}
+
+static uint64_t packet_box_scalar(const WideNode& node, int slot, const RayPacket& rays){
+    uint64_t hits = 0;
+    for (int i = 0; i < rays.count; ++i){
+	float tx0 = (node.min_x[slot] - rays.ox[i])*rays.ix[i];
+	float tx1 = (node.max_x[slot] - rays.ox[i])*rays.ix[i];
+	float ty0 = (node.min_y[slot] - rays.oy[i])*rays.iy[i];
+	float ty1 = (node.max_y[slot] - rays.oy[i])*rays.iy[i];
+	float tz0 = (node.min_z[slot] - rays.oz[i])*rays.iz[i];
+	float tz1 = (node.max_z[slot] - rays.oz[i])*rays.iz[i];
+	float near = std::max(std::max(std::min(tx0, tx1), std::min(ty0, ty1)), std::max(std::min(tz0, tz1), 0.0f));
+	float far = std::min(std::min(std::max(tx0, tx1), std::max(ty0, ty1)), std::max(tz0, tz1));
+	if (near <= far && near < rays.t[i])
+	    hits |= (uint64_t)1 << i;
+    }
+    return hits;
+}
+
+static void packet_triangles_scalar(const TriangleBlock* blocks, int count, uint64_t mask, RayPacket& rays){
+    for (int b = 0; b < count; ++b){
+	const TriangleBlock& block = blocks[b];
+	for (int k = 0; k < WIDTH && block.id[k] >= 0; ++k){
+	    float3 e1 = {block.e1_x[k], block.e1_y[k], block.e1_z[k]};
+	    float3 e2 = {block.e2_x[k], block.e2_y[k], block.e2_z[k]};
+	    float3 v0 = {block.v0_x[k], block.v0_y[k], block.v0_z[k]};
+	    for (uint64_t bits = mask; bits; bits &= bits - 1){
+		int i = __builtin_ctzll(bits);
+		float3 direction = {rays.dx[i], rays.dy[i], rays.dz[i]};
+		float3 tvec = float3({rays.ox[i], rays.oy[i], rays.oz[i]}) - v0;
+		float3 pvec = cross(direction, e2);
+		float det = 1.0f/dot(e1, pvec);
+		float u = dot(tvec, pvec)*det;
+		if (!(u >= 0 && u <= 1))
+		    continue;
+		float3 qvec = cross(tvec, e1);
+		float v = dot(direction, qvec)*det;
+		if (!(v >= 0 && u + v <= 1))
+		    continue;
+		float d = dot(e2, qvec)*det;
+		if (d > 0.000001f && d < rays.t[i]){
+		    rays.t[i] = d;
+		    rays.id[i] = block.id[k];
+		}
+	    }
+	}
+    }
+}
+
+#ifdef X86_SIMD
+
+__attribute__((target("avx2")))
+static int boxes_avx2(const WideNode& node, const RayData& ray, float t, float* dist){
+    __m256 ox = _mm256_set1_ps(ray.origin.x);
+    __m256 oy = _mm256_set1_ps(ray.origin.y);
+    __m256 oz = _mm256_set1_ps(ray.origin.z);
+    __m256 ix = _mm256_set1_ps(ray.inv_direction.x);
+    __m256 iy = _mm256_set1_ps(ray.inv_direction.y);
+    __m256 iz = _mm256_set1_ps(ray.inv_direction.z);
+    __m256 tx0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.min_x), ox), ix);
+    __m256 tx1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.max_x), ox), ix);
+    __m256 ty0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.min_y), oy), iy);
+    __m256 ty1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.max_y), oy), iy);
+    __m256 tz0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.min_z), oz), iz);
+    __m256 tz1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.max_z), oz), iz);
+    __m256 near = _mm256_max_ps(_mm256_max_ps(_mm256_min_ps(tx0, tx1), _mm256_min_ps(ty0, ty1)),
+				_mm256_max_ps(_mm256_min_ps(tz0, tz1), _mm256_setzero_ps()));
+    __m256 far = _mm256_min_ps(_mm256_min_ps(_mm256_max_ps(tx0, tx1), _mm256_max_ps(ty0, ty1)), _mm256_max_ps(tz0, tz1));
+    __m256 hit = _mm256_and_ps(_mm256_cmp_ps(near, far, _CMP_LE_OQ), _mm256_cmp_ps(near, _mm256_set1_ps(t), _CMP_LT_OQ));
+    _mm256_storeu_ps(dist, near);
+    return _mm256_movemask_ps(hit);
+}
+
+__attribute__((target("avx2")))
+static void triangles_avx2(const TriangleBlock* blocks, int count, const RayData& ray, float& t, int& id){
+    __m256 ox = _mm256_set1_ps(ray.origin.x);
+    __m256 oy = _mm256_set1_ps(ray.origin.y);
+    __m256 oz = _mm256_set1_ps(ray.origin.z);
+    __m256 dx = _mm256_set1_ps(ray.direction.x);
+    __m256 dy = _mm256_set1_ps(ray.direction.y);
+    __m256 dz = _mm256_set1_ps(ray.direction.z);
+    __m256 zero = _mm256_setzero_ps();
+    __m256 one = _mm256_set1_ps(1);
+    __m256 eps = _mm256_set1_ps(0.000001f);
+    for (int b = 0; b < count; ++b){
+	const TriangleBlock& block = blocks[b];
+	__m256 e1x = _mm256_loadu_ps(block.e1_x);
+	__m256 e1y = _mm256_loadu_ps(block.e1_y);
+	__m256 e1z = _mm256_loadu_ps(block.e1_z);
+	__m256 e2x = _mm256_loadu_ps(block.e2_x);
+	__m256 e2y = _mm256_loadu_ps(block.e2_y);
+	__m256 e2z = _mm256_loadu_ps(block.e2_z);
+	__m256 tx = _mm256_sub_ps(ox, _mm256_loadu_ps(block.v0_x));
+	__m256 ty = _mm256_sub_ps(oy, _mm256_loadu_ps(block.v0_y));
+	__m256 tz = _mm256_sub_ps(oz, _mm256_loadu_ps(block.v0_z));
+
+	__m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+	__m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+	__m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+	__m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, px), _mm256_mul_ps(e1y, py)), _mm256_mul_ps(e1z, pz));
+	det = _mm256_div_ps(one, det);
+	__m256 u = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(tx, px), _mm256_mul_ps(ty, py)), _mm256_mul_ps(tz, pz));
+	u = _mm256_mul_ps(u, det);
+
+	__m256 qx = _mm256_sub_ps(_mm256_mul_ps(ty, e1z), _mm256_mul_ps(tz, e1y));
+	__m256 qy = _mm256_sub_ps(_mm256_mul_ps(tz, e1x), _mm256_mul_ps(tx, e1z));
+	__m256 qz = _mm256_sub_ps(_mm256_mul_ps(tx, e1y), _mm256_mul_ps(ty, e1x));
+	__m256 v = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)), _mm256_mul_ps(dz, qz));
+	v = _mm256_mul_ps(v, det);
+	__m256 d = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)), _mm256_mul_ps(e2z, qz));
+	d = _mm256_mul_ps(d, det);
+
+	__m256 hit = _mm256_and_ps(_mm256_cmp_ps(u, zero, _CMP_GE_OQ), _mm256_cmp_ps(u, one, _CMP_LE_OQ));
+	hit = _mm256_and_ps(hit, _mm256_cmp_ps(v, zero, _CMP_GE_OQ));
+	hit = _mm256_and_ps(hit, _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_LE_OQ));
+	hit = _mm256_and_ps(hit, _mm256_cmp_ps(d, eps, _CMP_GT_OQ));
+	hit = _mm256_and_ps(hit, _mm256_cmp_ps(d, _mm256_set1_ps(t), _CMP_LT_OQ));
+	int hits = _mm256_movemask_ps(hit);
+	if (!hits)
+	    continue;
+	float dist[WIDTH];
+	_mm256_storeu_ps(dist, d);
+	for (; hits; hits &= hits - 1){
+	    int k = __builtin_ctz(hits);
+	    if (dist[k] < t){
+		t = dist[k];
+		id = block.id[k];
+	    }
+	}
+    }
+}
+
+__attribute__((target("avx2")))
+static uint64_t packet_box_avx2(const WideNode& node, int slot, const RayPacket& rays){
+    __m256 min_x = _mm256_set1_ps(node.min_x[slot]);
+    __m256 min_y = _mm256_set1_ps(node.min_y[slot]);
+    __m256 min_z = _mm256_set1_ps(node.min_z[slot]);
+    __m256 max_x = _mm256_set1_ps(node.max_x[slot]);
+    __m256 max_y = _mm256_set1_ps(node.max_y[slot]);
+    __m256 max_z = _mm256_set1_ps(node.max_z[slot]);
+    uint64_t hits = 0;
+    for (int g = 0; g < rays.count; g += 8){
+	__m256 ox = _mm256_loadu_ps(rays.ox + g);
+	__m256 oy = _mm256_loadu_ps(rays.oy + g);
+	__m256 oz = _mm256_loadu_ps(rays.oz + g);
+	__m256 ix = _mm256_loadu_ps(rays.ix + g);
+	__m256 iy = _mm256_loadu_ps(rays.iy + g);
+	__m256 iz = _mm256_loadu_ps(rays.iz + g);
+	__m256 tx0 = _mm256_mul_ps(_mm256_sub_ps(min_x, ox), ix);
+	__m256 tx1 = _mm256_mul_ps(_mm256_sub_ps(max_x, ox), ix);
+	__m256 ty0 = _mm256_mul_ps(_mm256_sub_ps(min_y, oy), iy);
+	__m256 ty1 = _mm256_mul_ps(_mm256_sub_ps(max_y, oy), iy);
+	__m256 tz0 = _mm256_mul_ps(_mm256_sub_ps(min_z, oz), iz);
+	__m256 tz1 = _mm256_mul_ps(_mm256_sub_ps(max_z, oz), iz);
+	__m256 near = _mm256_max_ps(_mm256_max_ps(_mm256_min_ps(tx0, tx1), _mm256_min_ps(ty0, ty1)),
+				    _mm256_max_ps(_mm256_min_ps(tz0, tz1), _mm256_setzero_ps()));
+	__m256 far = _mm256_min_ps(_mm256_min_ps(_mm256_max_ps(tx0, tx1), _mm256_max_ps(ty0, ty1)), _mm256_max_ps(tz0, tz1));
+	__m256 hit = _mm256_and_ps(_mm256_cmp_ps(near, far, _CMP_LE_OQ), _mm256_cmp_ps(near, _mm256_loadu_ps(rays.t + g), _CMP_LT_OQ));
+	hits |= (uint64_t)_mm256_movemask_ps(hit) << g;
+    }
+    return hits;
+}
+
+// one triangle at a time against eight rays
+__attribute__((target("avx2")))
+static void packet_triangles_avx2(const TriangleBlock* blocks, int count, uint64_t mask, RayPacket& rays){
+    const __m256i lane_bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+    __m256 zero = _mm256_setzero_ps();
+    __m256 one = _mm256_set1_ps(1);
+    __m256 eps = _mm256_set1_ps(0.000001f);
+    for (int b = 0; b < count; ++b){
+	const TriangleBlock& block = blocks[b];
+	for (int k = 0; k < WIDTH && block.id[k] >= 0; ++k){
+	    __m256 v0x = _mm256_set1_ps(block.v0_x[k]);
+	    __m256 v0y = _mm256_set1_ps(block.v0_y[k]);
+	    __m256 v0z = _mm256_set1_ps(block.v0_z[k]);
+	    __m256 e1x = _mm256_set1_ps(block.e1_x[k]);
+	    __m256 e1y = _mm256_set1_ps(block.e1_y[k]);
+	    __m256 e1z = _mm256_set1_ps(block.e1_z[k]);
+	    __m256 e2x = _mm256_set1_ps(block.e2_x[k]);
+	    __m256 e2y = _mm256_set1_ps(block.e2_y[k]);
+	    __m256 e2z = _mm256_set1_ps(block.e2_z[k]);
+	    __m256 tri = _mm256_castsi256_ps(_mm256_set1_epi32(block.id[k]));
+	    for (int g = 0; g < rays.count; g += 8){
+		int bits = (mask >> g) & 0xff;
+		if (!bits)
+		    continue;
+		__m256 dx = _mm256_loadu_ps(rays.dx + g);
+		__m256 dy = _mm256_loadu_ps(rays.dy + g);
+		__m256 dz = _mm256_loadu_ps(rays.dz + g);
+		__m256 tx = _mm256_sub_ps(_mm256_loadu_ps(rays.ox + g), v0x);
+		__m256 ty = _mm256_sub_ps(_mm256_loadu_ps(rays.oy + g), v0y);
+		__m256 tz = _mm256_sub_ps(_mm256_loadu_ps(rays.oz + g), v0z);
+
+		__m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+		__m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+		__m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+		__m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, px), _mm256_mul_ps(e1y, py)), _mm256_mul_ps(e1z, pz));
+		det = _mm256_div_ps(one, det);
+		__m256 u = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(tx, px), _mm256_mul_ps(ty, py)), _mm256_mul_ps(tz, pz));
+		u = _mm256_mul_ps(u, det);
+
+		__m256 qx = _mm256_sub_ps(_mm256_mul_ps(ty, e1z), _mm256_mul_ps(tz, e1y));
+		__m256 qy = _mm256_sub_ps(_mm256_mul_ps(tz, e1x), _mm256_mul_ps(tx, e1z));
+		__m256 qz = _mm256_sub_ps(_mm256_mul_ps(tx, e1y), _mm256_mul_ps(ty, e1x));
+		__m256 v = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)), _mm256_mul_ps(dz, qz));
+		v = _mm256_mul_ps(v, det);
+		__m256 d = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)), _mm256_mul_ps(e2z, qz));
+		d = _mm256_mul_ps(d, det);
+
+		__m256 t = _mm256_loadu_ps(rays.t + g);
+		__m256i lanes = _mm256_and_si256(_mm256_set1_epi32(bits), lane_bits);
+		__m256 hit = _mm256_castsi256_ps(_mm256_cmpeq_epi32(lanes, lane_bits));
+		hit = _mm256_and_ps(hit, _mm256_cmp_ps(u, zero, _CMP_GE_OQ));
+		hit = _mm256_and_ps(hit, _mm256_cmp_ps(u, one, _CMP_LE_OQ));
+		hit = _mm256_and_ps(hit, _mm256_cmp_ps(v, zero, _CMP_GE_OQ));
+		hit = _mm256_and_ps(hit, _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_LE_OQ));
+		hit = _mm256_and_ps(hit, _mm256_cmp_ps(d, eps, _CMP_GT_OQ));
+		hit = _mm256_and_ps(hit, _mm256_cmp_ps(d, t, _CMP_LT_OQ));
+		_mm256_storeu_ps(rays.t + g, _mm256_blendv_ps(t, d, hit));
+		__m256 id = _mm256_loadu_ps((const float*)(rays.id + g));
+		_mm256_storeu_ps((float*)(rays.id + g), _mm256_blendv_ps(id, tri, hit));
+	    }
+	}
+    }
+}
+
+// the same component of two blocks side by side
+__attribute__((target("avx512f")))
+static inline __m512 load_pair(const float* a, const float* b){
+    __m512d lo = _mm512_castpd256_pd512(_mm256_castps_pd(_mm256_loadu_ps(a)));
+    return _mm512_castpd_ps(_mm512_insertf64x4(lo, _mm256_castps_pd(_mm256_loadu_ps(b)), 1));
+}
+
+// sixteen triangles at a time, two blocks per pass. the boxes of a node
+// only fill eight lanes so they use the AVX2 test.
+__attribute__((target("avx512f")))
+static void triangles_avx512(const TriangleBlock* blocks, int count, const RayData& ray, float& t, int& id){
+    __m512 ox = _mm512_set1_ps(ray.origin.x);
+    __m512 oy = _mm512_set1_ps(ray.origin.y);
+    __m512 oz = _mm512_set1_ps(ray.origin.z);
+    __m512 dx = _mm512_set1_ps(ray.direction.x);
+    __m512 dy = _mm512_set1_ps(ray.direction.y);
+    __m512 dz = _mm512_set1_ps(ray.direction.z);
+    __m512 zero = _mm512_setzero_ps();
+    __m512 one = _mm512_set1_ps(1);
+    __m512 eps = _mm512_set1_ps(0.000001f);
+    int b = 0;
+    for (; b + 1 < count; b += 2){
+	const TriangleBlock& a = blocks[b];
+	const TriangleBlock& c = blocks[b + 1];
+	__m512 e1x = load_pair(a.e1_x, c.e1_x);
+	__m512 e1y = load_pair(a.e1_y, c.e1_y);
+	__m512 e1z = load_pair(a.e1_z, c.e1_z);
+	__m512 e2x = load_pair(a.e2_x, c.e2_x);
+	__m512 e2y = load_pair(a.e2_y, c.e2_y);
+	__m512 e2z = load_pair(a.e2_z, c.e2_z);
+	__m512 tx = _mm512_sub_ps(ox, load_pair(a.v0_x, c.v0_x));
+	__m512 ty = _mm512_sub_ps(oy, load_pair(a.v0_y, c.v0_y));
+	__m512 tz = _mm512_sub_ps(oz, load_pair(a.v0_z, c.v0_z));
+
+	__m512 px = _mm512_sub_ps(_mm512_mul_ps(dy, e2z), _mm512_mul_ps(dz, e2y));
+	__m512 py = _mm512_sub_ps(_mm512_mul_ps(dz, e2x), _mm512_mul_ps(dx, e2z));
+	__m512 pz = _mm512_sub_ps(_mm512_mul_ps(dx, e2y), _mm512_mul_ps(dy, e2x));
+	__m512 det = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(e1x, px), _mm512_mul_ps(e1y, py)), _mm512_mul_ps(e1z, pz));
+	det = _mm512_div_ps(one, det);
+	__m512 u = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(tx, px), _mm512_mul_ps(ty, py)), _mm512_mul_ps(tz, pz));
+	u = _mm512_mul_ps(u, det);
+
+	__m512 qx = _mm512_sub_ps(_mm512_mul_ps(ty, e1z), _mm512_mul_ps(tz, e1y));
+	__m512 qy = _mm512_sub_ps(_mm512_mul_ps(tz, e1x), _mm512_mul_ps(tx, e1z));
+	__m512 qz = _mm512_sub_ps(_mm512_mul_ps(tx, e1y), _mm512_mul_ps(ty, e1x));
+	__m512 v = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(dx, qx), _mm512_mul_ps(dy, qy)), _mm512_mul_ps(dz, qz));
+	v = _mm512_mul_ps(v, det);
+	__m512 d = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(e2x, qx), _mm512_mul_ps(e2y, qy)), _mm512_mul_ps(e2z, qz));
+	d = _mm512_mul_ps(d, det);
+
+	__mmask16 hits = _mm512_cmp_ps_mask(u, zero, _CMP_GE_OQ);
+	hits &= _mm512_cmp_ps_mask(u, one, _CMP_LE_OQ);
+	hits &= _mm512_cmp_ps_mask(v, zero, _CMP_GE_OQ);
+	hits &= _mm512_cmp_ps_mask(_mm512_add_ps(u, v), one, _CMP_LE_OQ);
+	hits &= _mm512_cmp_ps_mask(d, eps, _CMP_GT_OQ);
+	hits &= _mm512_cmp_ps_mask(d, _mm512_set1_ps(t), _CMP_LT_OQ);
+	if (!hits)
+	    continue;
+	float dist[2*WIDTH];
+	_mm512_storeu_ps(dist, d);
+	for (int bits = hits; bits; bits &= bits - 1){
+	    int k = __builtin_ctz(bits);
+	    if (dist[k] < t){
+		t = dist[k];
+		id = k < WIDTH ? a.id[k] : c.id[k - WIDTH];
+	    }
+	}
+    }
+    if (b < count)
+	triangles_avx2(blocks + b, 1, ray, t, id);
+}
+
+__attribute__((target("avx512f")))
+static uint64_t packet_box_avx512(const WideNode& node, int slot, const RayPacket& rays){
+    __m512 min_x = _mm512_set1_ps(node.min_x[slot]);
+    __m512 min_y = _mm512_set1_ps(node.min_y[slot]);
+    __m512 min_z = _mm512_set1_ps(node.min_z[slot]);
+    __m512 max_x = _mm512_set1_ps(node.max_x[slot]);
+    __m512 max_y = _mm512_set1_ps(node.max_y[slot]);
+    __m512 max_z = _mm512_set1_ps(node.max_z[slot]);
+    uint64_t hits = 0;
+    for (int g = 0; g < rays.count; g += 16){
+	__m512 ox = _mm512_loadu_ps(rays.ox + g);
+	__m512 oy = _mm512_loadu_ps(rays.oy + g);
+	__m512 oz = _mm512_loadu_ps(rays.oz + g);
+	__m512 ix = _mm512_loadu_ps(rays.ix + g);
+	__m512 iy = _mm512_loadu_ps(rays.iy + g);
+	__m512 iz = _mm512_loadu_ps(rays.iz + g);
+	__m512 tx0 = _mm512_mul_ps(_mm512_sub_ps(min_x, ox), ix);
+	__m512 tx1 = _mm512_mul_ps(_mm512_sub_ps(max_x, ox), ix);
+	__m512 ty0 = _mm512_mul_ps(_mm512_sub_ps(min_y, oy), iy);
+	__m512 ty1 = _mm512_mul_ps(_mm512_sub_ps(max_y, oy), iy);
+	__m512 tz0 = _mm512_mul_ps(_mm512_sub_ps(min_z, oz), iz);
+	__m512 tz1 = _mm512_mul_ps(_mm512_sub_ps(max_z, oz), iz);
+	__m512 near = _mm512_max_ps(_mm512_max_ps(_mm512_min_ps(tx0, tx1), _mm512_min_ps(ty0, ty1)),
+				    _mm512_max_ps(_mm512_min_ps(tz0, tz1), _mm512_setzero_ps()));
+	__m512 far = _mm512_min_ps(_mm512_min_ps(_mm512_max_ps(tx0, tx1), _mm512_max_ps(ty0, ty1)), _mm512_max_ps(tz0, tz1));
+	__mmask16 hit = _mm512_cmp_ps_mask(near, far, _CMP_LE_OQ) & _mm512_cmp_ps_mask(near, _mm512_loadu_ps(rays.t + g), _CMP_LT_OQ);
+	hits |= (uint64_t)hit << g;
+    }
+    return hits;
+}
+
+// one triangle at a time against sixteen rays
+__attribute__((target("avx512f")))
+static void packet_triangles_avx512(const TriangleBlock* blocks, int count, uint64_t mask, RayPacket& rays){
+    __m512 zero = _mm512_setzero_ps();
+    __m512 one = _mm512_set1_ps(1);
+    __m512 eps = _mm512_set1_ps(0.000001f);
+    for (int b = 0; b < count; ++b){
+	const TriangleBlock& block = blocks[b];
+	for (int k = 0; k < WIDTH && block.id[k] >= 0; ++k){
+	    __m512 v0x = _mm512_set1_ps(block.v0_x[k]);
+	    __m512 v0y = _mm512_set1_ps(block.v0_y[k]);
+	    __m512 v0z = _mm512_set1_ps(block.v0_z[k]);
+	    __m512 e1x = _mm512_set1_ps(block.e1_x[k]);
+	    __m512 e1y = _mm512_set1_ps(block.e1_y[k]);
+	    __m512 e1z = _mm512_set1_ps(block.e1_z[k]);
+	    __m512 e2x = _mm512_set1_ps(block.e2_x[k]);
+	    __m512 e2y = _mm512_set1_ps(block.e2_y[k]);
+	    __m512 e2z = _mm512_set1_ps(block.e2_z[k]);
+	    __m512i tri = _mm512_set1_epi32(block.id[k]);
+	    for (int g = 0; g < rays.count; g += 16){
+		__mmask16 lanes = (mask >> g) & 0xffff;
+		if (!lanes)
+		    continue;
+		__m512 dx = _mm512_loadu_ps(rays.dx + g);
+		__m512 dy = _mm512_loadu_ps(rays.dy + g);
+		__m512 dz = _mm512_loadu_ps(rays.dz + g);
+		__m512 tx = _mm512_sub_ps(_mm512_loadu_ps(rays.ox + g), v0x);
+		__m512 ty = _mm512_sub_ps(_mm512_loadu_ps(rays.oy + g), v0y);
+		__m512 tz = _mm512_sub_ps(_mm512_loadu_ps(rays.oz + g), v0z);
+
+		__m512 px = _mm512_sub_ps(_mm512_mul_ps(dy, e2z), _mm512_mul_ps(dz, e2y));
+		__m512 py = _mm512_sub_ps(_mm512_mul_ps(dz, e2x), _mm512_mul_ps(dx, e2z));
+		__m512 pz = _mm512_sub_ps(_mm512_mul_ps(dx, e2y), _mm512_mul_ps(dy, e2x));
+		__m512 det = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(e1x, px), _mm512_mul_ps(e1y, py)), _mm512_mul_ps(e1z, pz));
+		det = _mm512_div_ps(one, det);
+		__m512 u = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(tx, px), _mm512_mul_ps(ty, py)), _mm512_mul_ps(tz, pz));
+		u = _mm512_mul_ps(u, det);
+
+		__m512 qx = _mm512_sub_ps(_mm512_mul_ps(ty, e1z), _mm512_mul_ps(tz, e1y));
+		__m512 qy = _mm512_sub_ps(_mm512_mul_ps(tz, e1x), _mm512_mul_ps(tx, e1z));
+		__m512 qz = _mm512_sub_ps(_mm512_mul_ps(tx, e1y), _mm512_mul_ps(ty, e1x));
+		__m512 v = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(dx, qx), _mm512_mul_ps(dy, qy)), _mm512_mul_ps(dz, qz));
+		v = _mm512_mul_ps(v, det);
+		__m512 d = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(e2x, qx), _mm512_mul_ps(e2y, qy)), _mm512_mul_ps(e2z, qz));
+		d = _mm512_mul_ps(d, det);
+
+		__m512 t = _mm512_loadu_ps(rays.t + g);
+		__mmask16 hit = _mm512_mask_cmp_ps_mask(lanes, u, zero, _CMP_GE_OQ);
+		hit = _mm512_mask_cmp_ps_mask(hit, u, one, _CMP_LE_OQ);
+		hit = _mm512_mask_cmp_ps_mask(hit, v, zero, _CMP_GE_OQ);
+		hit = _mm512_mask_cmp_ps_mask(hit, _mm512_add_ps(u, v), one, _CMP_LE_OQ);
+		hit = _mm512_mask_cmp_ps_mask(hit, d, eps, _CMP_GT_OQ);
+		hit = _mm512_mask_cmp_ps_mask(hit, d, t, _CMP_LT_OQ);
+		_mm512_storeu_ps(rays.t + g, _mm512_mask_mov_ps(t, hit, d));
+		__m512i id = _mm512_loadu_si512(rays.id + g);
+		_mm512_storeu_si512(rays.id + g, _mm512_mask_mov_epi32(id, hit, tri));
+	    }
+	}
+    }
+}
+
+#endif
+
+ISA best_isa(){
+#ifdef X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+	return ISA_AVX512;
+    if (__builtin_cpu_supports("avx2"))
+	return ISA_AVX2;
+#endif
+    return ISA_SCALAR;
+}
+
+const char* isa_name(ISA isa){
+    switch (isa){
+    case ISA_AVX512:
+	return "avx512";
+    case ISA_AVX2:
+	return "avx2";
+    default:
+	return "scalar";
+    }
+}
+
+IntersectFunctions intersect_functions(ISA isa){
+#ifdef X86_SIMD
+    if (isa == ISA_AVX512)
+	return {boxes_avx2, triangles_avx512, packet_box_avx512, packet_triangles_avx512};
+    if (isa == ISA_AVX2)
+	return {boxes_avx2, triangles_avx2, packet_box_avx2, packet_triangles_avx2};
+#endif
+    return {boxes_scalar, triangles_scalar, packet_box_scalar, packet_triangles_scalar};
+}
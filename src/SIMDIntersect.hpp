@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstdint>
+
+#include "float3.h"
+
+// children per wide node and triangles per block
+const int WIDTH = 8;
+// most rays traced together as a packet
+const int PACKET_SIZE = 64;
+
+// the boxes of up to eight children stored by component, so one ray is
+// tested against all of them at once. empty slots hold a box far outside
+// the scene that nothing can hit.
+struct WideNode{
+    float min_x[WIDTH], min_y[WIDTH], min_z[WIDTH];
+    float max_x[WIDTH], max_y[WIDTH], max_z[WIDTH];
+    int child[WIDTH]; // node for inner children, first triangle block for leaves
+    int count[WIDTH]; // triangle blocks in a leaf, 0 for inner children
+};
+
+// eight triangles stored by component with their edges precomputed. unused
+// lanes are NaN so they never report a hit.
+struct TriangleBlock{
+    float v0_x[WIDTH], v0_y[WIDTH], v0_z[WIDTH];
+    float e1_x[WIDTH], e1_y[WIDTH], e1_z[WIDTH]; // vert1 - vert0
+    float e2_x[WIDTH], e2_y[WIDTH], e2_z[WIDTH]; // vert2 - vert0
+    int id[WIDTH]; // index in BVH::ordered
+};
+
+struct RayData{
+    float3 origin;
+    float3 direction;
+    float3 inv_direction;
+};
+
+// rays stored by component so one triangle or box is tested against eight
+// or sixteen of them at once. lanes past count are NaN.
+struct RayPacket{
+    float ox[PACKET_SIZE], oy[PACKET_SIZE], oz[PACKET_SIZE];
+    float dx[PACKET_SIZE], dy[PACKET_SIZE], dz[PACKET_SIZE];
+    float ix[PACKET_SIZE], iy[PACKET_SIZE], iz[PACKET_SIZE]; // inverse directions
+    float t[PACKET_SIZE]; // closest hit so far
+    int id[PACKET_SIZE];
+    int count;
+};
+
+enum ISA{
+    ISA_SCALAR,
+    ISA_AVX2,
+    ISA_AVX512
+};
+
+// set bit k of the result and dist[k] to the entry distance for every child
+// of node the ray enters before t
+typedef int (*BoxTest)(const WideNode& node, const RayData& ray, float t, float* dist);
+// update t and id with the closest hit closer than t in count blocks
+typedef void (*TriangleTest)(const TriangleBlock* blocks, int count, const RayData& ray, float& t, int& id);
+
+// bit i of the result set for every ray i of the packet that enters child
+// slot of node before its t
+typedef uint64_t (*PacketBoxTest)(const WideNode& node, int slot, const RayPacket& rays);
+// update t and id of the rays in mask with their closest hits in count blocks
+typedef void (*PacketTriangleTest)(const TriangleBlock* blocks, int count, uint64_t mask, RayPacket& rays);
+
+struct IntersectFunctions{
+    BoxTest boxes;
+    TriangleTest triangles;
+    PacketBoxTest packet_box;
+    PacketTriangleTest packet_triangles;
+};
+
+ISA best_isa(); // highest level the cpu running this supports
+const char* isa_name(ISA isa);
+IntersectFunctions intersect_functions(ISA isa);
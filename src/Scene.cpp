@@ -28,7 +28,7 @@ void Scene::load_materials(std::string filename){
     float3 color = {0,0,0};
     float3 emission = {0,0,0};
     BRDF brdf = LAMBERTIAN;
-    float alpha;
+    float alpha = 0;
     float idx = 0;
     float3 attenuation = {0,0,0};
     while (getline(material_file, line)){
@@ -123,7 +123,9 @@ void Scene::load_camera(std::string filename){
     float3 from;
     float3 to;
     float aperture;
-    float lens_radius;
+    float lens_radius = 0;
+    float focus_distance = 0;
+    CameraType model = PERSPECTIVE;
     while(getline(camera_file, line)){
         line_num++;
         std::istringstream str(line);
@@ -159,8 +161,26 @@ void Scene::load_camera(std::string filename){
             if (lens_radius < -1e19)
                 print_error(filename + ":" + std::to_string(line_num) + ": No lens radius specified");
         }
+        if (type == "d"){
+            focus_distance = -1e20;
+            str >> focus_distance;
+            if (focus_distance < -1e19)
+                print_error(filename + ":" + std::to_string(line_num) + ": No focus distance specified");
+        }
+        if (type == "m"){
+            std::string model_name;
+            str >> model_name;
+            if (model_name == "perspective")
+                model = PERSPECTIVE;
+            else if (model_name == "orthographic")
+                model = ORTHOGRAPHIC;
+            else if (model_name == "panoramic")
+                model = PANORAMIC;
+            else
+                print_error(filename + ":" + std::to_string(line_num) + ": Couldn't understand camera model");
+        }
     }
-    camera = {from, to, (float)(M_PI*aperture/180), lens_radius};
+    camera = {from, to, (float)(M_PI*aperture/180), lens_radius, focus_distance, model};
 }
 
 void Scene::load_ply(std::string filename, int mat_idx, float3 translate, float scale, float3 xaxis, float3 yaxis){
@@ -279,6 +299,12 @@ Scene::Scene(std::string filename){
                 else
                     load_obj(load_name, current_material, t, s, x, y);
             }
+            else if ((extension == "hdr") || (extension == "pfm")){
+                float intensity;
+                if (!(str >> intensity))
+                    intensity = 1;
+                environment.load(load_name, intensity);
+            }
             else
                 print_error(filename + ":" + std::to_string(line_num) + ": Extension not recognized");
         }
@@ -310,5 +336,63 @@ Scene::Scene(std::string filename){
             triangles.push_back({verticies[v0],verticies[v1],verticies[v2], current_material});
         }
     }
+}
+
+void Scene::build_bvh(){
+    std::clog << "Building BVH..." << std::endl;
     bvh = BVH(triangles);
 }
+
+SceneFeatures Scene::features() const{
+    SceneFeatures f = {false, false, false, false, false};
+    for (const Material& mat : materials){
+	f.lambertian |= mat.type == LAMBERTIAN;
+	f.cook_torrance |= mat.type == COOK_TORRANCE;
+	f.refraction |= mat.ref_idx != 0;
+    }
+    f.lens = camera.type == PERSPECTIVE && camera.lens_radius != 0;
+    f.environment = !environment.empty();
+    return f;
+}
+
+// FNV-1a over the values rather than the structs, their padding isn't set
+static void hash_bytes(uint64_t& h, const void* data, size_t size){
+    const unsigned char* bytes = (const unsigned char*)data;
+    for (size_t i = 0; i < size; ++i){
+	h ^= bytes[i];
+	h *= 1099511628211ull;
+    }
+}
+
+static void hash_float3(uint64_t& h, float3 v){
+    hash_bytes(h, v.s, 3*sizeof(float));
+}
+
+uint64_t Scene::hash() const{
+    uint64_t h = 14695981039346656037ull;
+    for (const Triangle& tri : triangles){
+	hash_float3(h, tri.vert0);
+	hash_float3(h, tri.vert1);
+	hash_float3(h, tri.vert2);
+	hash_bytes(h, &tri.material, sizeof(int));
+    }
+    for (const Material& mat : materials){
+	hash_float3(h, mat.color);
+	hash_float3(h, mat.emission);
+	hash_bytes(h, &mat.type, sizeof(BRDF));
+	hash_bytes(h, &mat.alpha, sizeof(float));
+	hash_bytes(h, &mat.ref_idx, sizeof(float));
+	hash_float3(h, mat.attenuation);
+    }
+    hash_float3(h, camera.location);
+    hash_float3(h, camera.looking_at);
+    hash_bytes(h, &camera.aperture, sizeof(float));
+    hash_bytes(h, &camera.lens_radius, sizeof(float));
+    hash_bytes(h, &camera.focus_distance, sizeof(float));
+    hash_bytes(h, &camera.type, sizeof(CameraType));
+    hash_bytes(h, &environment.width, sizeof(int));
+    hash_bytes(h, &environment.height, sizeof(int));
+    for (const float3& p : environment.pixels)
+	hash_float3(h, p);
+    return h;
+}
@@ -1,14 +1,25 @@
 #pragma once
 
+#include <cstdint>
 #include <map>
 #include <string>
 #include <vector>
 
 #include "BVH.hpp"
 #include "Camera.h"
+#include "Environment.hpp"
 #include "Material.h"
 #include "Triangle.h"
 
+// what a scene needs from the integrator, so backends can leave out the rest
+struct SceneFeatures{
+    bool lambertian;
+    bool cook_torrance;
+    bool refraction;
+    bool lens;
+    bool environment;
+};
+
 class Scene{
 private:
     std::map<std::string, int> material_idx;
@@ -21,5 +32,11 @@ public:
     BVH bvh;
     std::vector<Material> materials;
     Camera camera;
-    Scene(std::string filename);
+    Environment environment; // empty for the default sky
+    Scene(std::string filename); // only parses, call build_bvh before rendering
+    void build_bvh();
+    SceneFeatures features() const;
+    // of everything that changes the image, so a checkpoint is only resumed
+    // for the scene it was taken of
+    uint64_t hash() const;
 };
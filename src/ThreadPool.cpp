@@ -0,0 +1,90 @@
+#include <algorithm>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#include "ThreadPool.hpp"
+
+ThreadPool::ThreadPool(int num_threads){
+    if (num_threads <= 0)
+	num_threads = std::max(1u, std::thread::hardware_concurrency());
+    for (int i = 0; i < num_threads; ++i)
+	queues.emplace_back(new Queue);
+    for (int i = 0; i < num_threads; ++i)
+	threads.emplace_back(&ThreadPool::worker, this, i);
+}
+
+ThreadPool::~ThreadPool(){
+    {
+	std::lock_guard<std::mutex> guard(lock);
+	stop = true;
+    }
+    start.notify_all();
+    for (std::thread& t : threads)
+	t.join();
+}
+
+void ThreadPool::run(int tasks, std::function<void(int, int)> fn){
+    if (tasks <= 0)
+	return;
+    std::unique_lock<std::mutex> guard(lock);
+    job = fn;
+    remaining = tasks;
+    finished_workers = 0;
+    // deal the tasks out round robin so neighbouring tasks start on different threads
+    for (int i = 0; i < tasks; ++i){
+	Queue& q = *queues[i % queues.size()];
+	std::lock_guard<std::mutex> qguard(q.lock);
+	q.tasks.push_back(i);
+    }
+    ++generation;
+    start.notify_all();
+    // every worker has to check in, otherwise a late one could pick up the next job's tasks
+    done.wait(guard, [this]{return remaining == 0 && finished_workers == (int)threads.size();});
+}
+
+// own tasks come off the back, stolen ones off the front of someone else's queue
+bool ThreadPool::next_task(int id, int& task){
+    for (size_t i = 0; i < queues.size(); ++i){
+	Queue& q = *queues[(id + i) % queues.size()];
+	std::lock_guard<std::mutex> guard(q.lock);
+	if (q.tasks.empty())
+	    continue;
+	if (i == 0){
+	    task = q.tasks.back();
+	    q.tasks.pop_back();
+	}
+	else{
+	    task = q.tasks.front();
+	    q.tasks.pop_front();
+	}
+	return true;
+    }
+    return false;
+}
+
+void ThreadPool::worker(int id){
+    int seen = 0;
+    while (true){
+	std::function<void(int, int)> fn;
+	{
+	    std::unique_lock<std::mutex> guard(lock);
+	    start.wait(guard, [&]{return stop || generation != seen;});
+	    if (stop)
+		return;
+	    seen = generation;
+	    fn = job;
+	}
+	int task;
+	int finished = 0;
+	while (next_task(id, task)){
+	    fn(task, id);
+	    ++finished;
+	}
+	std::lock_guard<std::mutex> guard(lock);
+	remaining -= finished;
+	++finished_workers;
+	if (remaining == 0 && finished_workers == (int)threads.size())
+	    done.notify_all();
+    }
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// persistent worker threads that split a job into tasks. each worker has its
+// own queue and steals from the others once it runs dry, so uneven tasks
+// (like tiles that hit glass) still keep every core busy.
+class ThreadPool{
+private:
+    struct Queue{
+	std::mutex lock;
+	std::deque<int> tasks;
+    };
+    void worker(int id);
+    bool next_task(int id, int& task);
+    std::vector<std::thread> threads;
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::function<void(int, int)> job;
+    std::mutex lock;
+    std::condition_variable start;
+    std::condition_variable done;
+    int generation = 0;
+    int remaining = 0;
+    int finished_workers = 0;
+    bool stop = false;
+public:
+    ThreadPool(int num_threads = 0); // 0 for one per core
+    ~ThreadPool();
+    int size() const {return threads.size();}
+    // call fn(task, thread) for every task in [0, tasks) and wait for all of them
+    void run(int tasks, std::function<void(int, int)> fn);
+};
@@ -0,0 +1,122 @@
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <cmath>
+
+#include "float3.h"
+#include "ThreadPool.hpp"
+#include "Tonemap.hpp"
+
+const long VALUES_PER_TASK = 1 << 16;
+
+// the curves map linear values to display values in [0, 1]
+static double gamma_curve(float x){
+    return pow(std::min(std::max(x, 0.0f), 1.0f), 1/2.2);
+}
+
+static double srgb_encode(double x){
+    x = std::min(std::max(x, 0.0), 1.0);
+    return x <= 0.0031308 ? 12.92*x : 1.055*pow(x, 1/2.4) - 0.055;
+}
+
+static double srgb_curve(float x){
+    return srgb_encode(x);
+}
+
+// per channel, written so it reaches 1 at infinity rather than dividing it by itself
+static double reinhard_curve(float x){
+    return srgb_encode(1 - 1/(1 + std::max((double)x, 0.0)));
+}
+
+// Narkowicz's fit of the ACES filmic curve
+static double aces_curve(float x){
+    double v = std::min(std::max((double)x, 0.0), 1e6);
+    return srgb_encode(v*(2.51*v + 0.03)/(v*(2.43*v + 0.59) + 0.14));
+}
+
+struct Operator{
+    const char* name;
+    double (*curve)(float);
+};
+
+static const Operator OPERATORS[] = {
+    {"gamma", gamma_curve},
+    {"srgb", srgb_curve},
+    {"reinhard", reinhard_curve},
+    {"aces", aces_curve},
+};
+
+static int level(double (*curve)(float), float x){
+    return int(curve(x)*255 + 0.5);
+}
+
+bool Tonemapper::exists(std::string name){
+    for (const Operator& op : OPERATORS)
+	if (name == op.name)
+	    return true;
+    return false;
+}
+
+// the bit patterns of positive floats sort the same way as the floats, so
+// each threshold is found by bisecting them. levels a curve never reaches
+// get infinity
+Tonemapper::Tonemapper(std::string name) : lut(255){
+    double (*curve)(float) = gamma_curve;
+    for (const Operator& op : OPERATORS)
+	if (name == op.name)
+	    curve = op.curve;
+    for (int l = 1; l <= 255; ++l){
+	union{
+	    float f;
+	    int32_t bits;
+	} lo, hi, mid;
+	lo.f = 0;
+	hi.f = 1e30;
+	if (level(curve, hi.f) < l){
+	    lut[l - 1] = INFINITY;
+	    continue;
+	}
+	while (hi.bits - lo.bits > 1){
+	    mid.bits = lo.bits + (hi.bits - lo.bits)/2;
+	    (level(curve, mid.f) >= l ? hi : lo) = mid;
+	}
+	lut[l - 1] = level(curve, lo.f) >= l ? lo.f : hi.f;
+    }
+}
+
+// the search is written out step by step so every value takes the same
+// path, and the loop vectorizes with gathers from the table
+__attribute__((target_clones("avx2", "default")))
+static void tonemap_values(const float* in, unsigned char* out, long count, const float* lut){
+#pragma GCC ivdep
+    for (long i = 0; i < count; ++i){
+	const float x = in[i];
+	int l = x >= lut[127] ? 128 : 0;
+	l += x >= lut[l + 63] ? 64 : 0;
+	l += x >= lut[l + 31] ? 32 : 0;
+	l += x >= lut[l + 15] ? 16 : 0;
+	l += x >= lut[l + 7] ? 8 : 0;
+	l += x >= lut[l + 3] ? 4 : 0;
+	l += x >= lut[l + 1] ? 2 : 0;
+	l += x >= lut[l] ? 1 : 0;
+	out[i] = l;
+    }
+}
+
+// float3 has a fourth float, so the pixels are four floats to four bytes and
+// the fourth becomes the alpha
+void Tonemapper::apply(const std::vector<float3>& image, std::vector<unsigned char>& rgba, ThreadPool& pool) const{
+    const long values = 4*(long)image.size();
+    const float* in = (const float*)image.data();
+    rgba.resize(values);
+    const int tasks = (values + VALUES_PER_TASK - 1)/VALUES_PER_TASK;
+    pool.run(tasks, [&](int task, int thread){
+	long begin = task*VALUES_PER_TASK;
+	long end = std::min(values, begin + VALUES_PER_TASK);
+	tonemap_values(in + begin, rgba.data() + begin, end - begin, lut.data());
+	for (long i = begin + 3; i < end; i += 4)
+	    rgba[i] = 255;
+    });
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "float3.h"
+#include "ThreadPool.hpp"
+
+// turns linear colour into 8 bit display values. every operator is a curve
+// that only goes up, so it is kept as a table of the smallest value that
+// reaches each level from 1 to 255 and applied with a binary search. that
+// is exact, vectorizes, and runs the same in the post process kernel.
+class Tonemapper{
+public:
+    std::vector<float> lut;
+    Tonemapper(std::string name); // gamma, srgb, reinhard or aces
+    static bool exists(std::string name);
+    // rgba has 4 bytes for every pixel of image, blocks of it are shared out over pool
+    void apply(const std::vector<float3>& image, std::vector<unsigned char>& rgba, ThreadPool& pool) const;
+};
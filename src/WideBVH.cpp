@@ -0,0 +1,309 @@
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "BVH.hpp"
+#include "GPU_BVHnode.h"
+#include "Ray.h"
+#include "SIMDIntersect.hpp"
+#include "WideBVH.hpp"
+
+const int LEAF_SIZE = 2*WIDTH; // subtrees with at most this many triangles become leaves
+const float EMPTY = 1e30;      // corner of the box in unused slots
+
+static bool is_leaf(const GPU_BVHnode& node){
+    return node.u.leaf.count & 0x80000000;
+}
+
+static float area(const GPU_BVHnode& node){
+    float3 size = node.max - node.min;
+    return size.x*size.y + size.y*size.z + size.z*size.x;
+}
+
+static int count_triangles(const std::vector<GPU_BVHnode>& nodes, int root, std::vector<int>& sizes){
+    const GPU_BVHnode& node = nodes[root];
+    if (is_leaf(node))
+	sizes[root] = node.u.leaf.count & 0x7fffffff;
+    else
+	sizes[root] = count_triangles(nodes, node.u.inner.left, sizes) + count_triangles(nodes, node.u.inner.right, sizes);
+    return sizes[root];
+}
+
+WideBVH::WideBVH(const BVH& bvh, ISA isa) : functions(intersect_functions(isa)){
+    if (bvh.GPU_BVH.empty())
+	return;
+    sizes = std::vector<int>(bvh.GPU_BVH.size());
+    count_triangles(bvh.GPU_BVH, 0, sizes);
+    collapse(bvh, 0);
+}
+
+void WideBVH::gather(const BVH& bvh, int root, std::vector<int>& ids){
+    const GPU_BVHnode& node = bvh.GPU_BVH[root];
+    if (is_leaf(node)){
+	unsigned int end = node.u.leaf.offset + (node.u.leaf.count & 0x7fffffff);
+	for (unsigned int i = node.u.leaf.offset; i < end; ++i)
+	    ids.push_back(i);
+    }
+    else{
+	gather(bvh, node.u.inner.left, ids);
+	gather(bvh, node.u.inner.right, ids);
+    }
+}
+
+void WideBVH::add_leaf(const BVH& bvh, int root, WideNode& node, int slot){
+    std::vector<int> ids;
+    gather(bvh, root, ids);
+    node.child[slot] = blocks.size();
+    node.count[slot] = (ids.size() + WIDTH - 1)/WIDTH;
+    for (size_t i = 0; i < ids.size(); i += WIDTH){
+	TriangleBlock block;
+	for (int k = 0; k < WIDTH; ++k){
+	    if (i + k < ids.size()){
+		const Triangle& tri = bvh.ordered[ids[i + k]];
+		float3 e1 = tri.vert1 - tri.vert0;
+		float3 e2 = tri.vert2 - tri.vert0;
+		block.v0_x[k] = tri.vert0.x; block.v0_y[k] = tri.vert0.y; block.v0_z[k] = tri.vert0.z;
+		block.e1_x[k] = e1.x; block.e1_y[k] = e1.y; block.e1_z[k] = e1.z;
+		block.e2_x[k] = e2.x; block.e2_y[k] = e2.y; block.e2_z[k] = e2.z;
+		block.id[k] = ids[i + k];
+	    }
+	    else{
+		block.v0_x[k] = block.v0_y[k] = block.v0_z[k] = NAN;
+		block.e1_x[k] = block.e1_y[k] = block.e1_z[k] = NAN;
+		block.e2_x[k] = block.e2_y[k] = block.e2_z[k] = NAN;
+		block.id[k] = -1;
+	    }
+	}
+	blocks.push_back(block);
+    }
+}
+
+// returns the index of the new node
+int WideBVH::collapse(const BVH& bvh, int root){
+    const std::vector<GPU_BVHnode>& in = bvh.GPU_BVH;
+    int index = nodes.size();
+    nodes.push_back(WideNode());
+
+    // open up the biggest child that is still too large for a leaf until the node is full
+    std::vector<int> children;
+    if (is_leaf(in[root]))
+	children.push_back(root);
+    else{
+	children.push_back(in[root].u.inner.left);
+	children.push_back(in[root].u.inner.right);
+    }
+    while (children.size() < (size_t)WIDTH){
+	int best = -1;
+	for (size_t k = 0; k < children.size(); ++k){
+	    const GPU_BVHnode& child = in[children[k]];
+	    if (is_leaf(child) || sizes[children[k]] <= LEAF_SIZE)
+		continue;
+	    if (best < 0 || area(child) > area(in[children[best]]))
+		best = k;
+	}
+	if (best < 0)
+	    break;
+	const GPU_BVHnode& opened = in[children[best]];
+	children[best] = opened.u.inner.left;
+	children.push_back(opened.u.inner.right);
+    }
+
+    // nodes can move while the children are collapsed, so fill in a copy
+    WideNode node;
+    for (int k = 0; k < WIDTH; ++k){
+	node.min_x[k] = node.min_y[k] = node.min_z[k] = EMPTY;
+	node.max_x[k] = node.max_y[k] = node.max_z[k] = EMPTY;
+	node.child[k] = -1;
+	node.count[k] = 0;
+    }
+    for (size_t k = 0; k < children.size(); ++k){
+	const GPU_BVHnode& child = in[children[k]];
+	node.min_x[k] = child.min.x; node.min_y[k] = child.min.y; node.min_z[k] = child.min.z;
+	node.max_x[k] = child.max.x; node.max_y[k] = child.max.y; node.max_z[k] = child.max.z;
+	if (is_leaf(child) || sizes[children[k]] <= LEAF_SIZE)
+	    add_leaf(bvh, children[k], node, k);
+	else
+	    node.child[k] = collapse(bvh, children[k]);
+    }
+    nodes[index] = node;
+    return index;
+}
+
+static RayData ray_data(const Ray& ray){
+    RayData data;
+    data.origin = ray.origin;
+    data.direction = ray.direction;
+    data.inv_direction = {1/ray.direction.x, 1/ray.direction.y, 1/ray.direction.z};
+    return data;
+}
+
+bool WideBVH::intersect(const Ray& ray, float& t, int& id) const{
+    t = 1e20;
+    id = -1;
+    if (nodes.empty())
+	return false;
+    RayData data = ray_data(ray);
+
+    // nodes waiting to be visited with the distance to their box, nearest on top
+    struct Entry{
+	int node;
+	float dist;
+    };
+    Entry stack[512];
+    int size = 1;
+    stack[0] = {0, 0};
+    float dist[WIDTH];
+    while (size){
+	Entry entry = stack[--size];
+	if (entry.dist >= t)
+	    continue;
+	const WideNode& node = nodes[entry.node];
+	int first = size;
+	for (int hits = functions.boxes(node, data, t, dist); hits; hits &= hits - 1){
+	    int k = __builtin_ctz(hits);
+	    if (node.count[k]){
+		functions.triangles(&blocks[node.child[k]], node.count[k], data, t, id);
+		continue;
+	    }
+	    int j = size++;
+	    for (; j > first && stack[j - 1].dist < dist[k]; --j)
+		stack[j] = stack[j - 1];
+	    stack[j] = {node.child[k], dist[k]};
+	}
+    }
+    return id >= 0;
+}
+
+// bounds on the origins and inverse directions of a packet of rays. the
+// box tests are then done with intervals, so a box no ray of the packet
+// can enter is skipped without testing any of them.
+struct Frustum{
+    bool valid; // false if the rays go both ways along an axis
+    float origin_min[3];
+    float origin_max[3];
+    float inv_min[3];
+    float inv_max[3];
+};
+
+static Frustum make_frustum(const RayPacket& rays){
+    const float* origins[3] = {rays.ox, rays.oy, rays.oz};
+    const float* invs[3] = {rays.ix, rays.iy, rays.iz};
+    Frustum f;
+    f.valid = true;
+    for (int a = 0; a < 3; ++a){
+	f.origin_min[a] = f.origin_max[a] = origins[a][0];
+	f.inv_min[a] = f.inv_max[a] = invs[a][0];
+	for (int i = 0; i < rays.count; ++i){
+	    f.valid &= std::isfinite(invs[a][i]) && (invs[a][i] > 0) == (invs[a][0] > 0);
+	    f.origin_min[a] = std::min(f.origin_min[a], origins[a][i]);
+	    f.origin_max[a] = std::max(f.origin_max[a], origins[a][i]);
+	    f.inv_min[a] = std::min(f.inv_min[a], invs[a][i]);
+	    f.inv_max[a] = std::max(f.inv_max[a], invs[a][i]);
+	}
+    }
+    return f;
+}
+
+// children of node some ray of the frustum could enter before t, with a
+// lower bound on where every ray enters them
+static int frustum_test(const WideNode& node, const Frustum& f, float t, float* near_bound){
+    const float* mins[3] = {node.min_x, node.min_y, node.min_z};
+    const float* maxs[3] = {node.max_x, node.max_y, node.max_z};
+    int hits = 0;
+    for (int k = 0; k < WIDTH; ++k){
+	float near = 0;
+	float far = t;
+	for (int a = 0; a < 3; ++a){
+	    bool positive = f.inv_min[a] > 0;
+	    float near_plane = positive ? mins[a][k] : maxs[a][k];
+	    float far_plane = positive ? maxs[a][k] : mins[a][k];
+	    // the distance to a plane is (plane - origin)*inv, take its extremes over both intervals
+	    float n0 = (near_plane - f.origin_max[a])*f.inv_min[a];
+	    float n1 = (near_plane - f.origin_max[a])*f.inv_max[a];
+	    float n2 = (near_plane - f.origin_min[a])*f.inv_min[a];
+	    float n3 = (near_plane - f.origin_min[a])*f.inv_max[a];
+	    float f0 = (far_plane - f.origin_max[a])*f.inv_min[a];
+	    float f1 = (far_plane - f.origin_max[a])*f.inv_max[a];
+	    float f2 = (far_plane - f.origin_min[a])*f.inv_min[a];
+	    float f3 = (far_plane - f.origin_min[a])*f.inv_max[a];
+	    near = std::max(near, std::min(std::min(n0, n1), std::min(n2, n3)));
+	    far = std::min(far, std::max(std::max(f0, f1), std::max(f2, f3)));
+	}
+	near_bound[k] = near;
+	if (near <= far)
+	    hits |= 1 << k;
+    }
+    return hits;
+}
+
+// the packet walks the tree together. inner nodes are only tested against
+// the frustum, once for the whole packet rather than once per ray. leaves
+// are tested a triangle at a time against every ray that enters them, so
+// small leaves still fill the SIMD lanes. rays whose directions differ in
+// sign have no frustum and are traced one at a time.
+void WideBVH::intersect_packet(const Ray* rays, int count, float* t, int* id) const{
+    RayPacket packet;
+    packet.count = count;
+    for (int i = 0; i < PACKET_SIZE; ++i){
+	bool used = i < count;
+	packet.ox[i] = used ? rays[i].origin.x : NAN;
+	packet.oy[i] = used ? rays[i].origin.y : NAN;
+	packet.oz[i] = used ? rays[i].origin.z : NAN;
+	packet.dx[i] = used ? rays[i].direction.x : NAN;
+	packet.dy[i] = used ? rays[i].direction.y : NAN;
+	packet.dz[i] = used ? rays[i].direction.z : NAN;
+	packet.ix[i] = 1/packet.dx[i];
+	packet.iy[i] = 1/packet.dy[i];
+	packet.iz[i] = 1/packet.dz[i];
+	packet.t[i] = 1e20;
+	packet.id[i] = -1;
+    }
+    Frustum frustum = make_frustum(packet);
+    if (!frustum.valid || nodes.empty()){
+	for (int i = 0; i < count; ++i)
+	    intersect(rays[i], t[i], id[i]);
+	return;
+    }
+
+    // nodes waiting to be visited with a bound on where the packet enters them, nearest on top
+    struct Entry{
+	int node;
+	float bound;
+    };
+    Entry stack[512];
+    int size = 1;
+    stack[0] = {0, 0};
+    float t_max = 1e20;
+    float bound[WIDTH];
+    while (size){
+	Entry entry = stack[--size];
+	if (entry.bound >= t_max)
+	    continue;
+	const WideNode& node = nodes[entry.node];
+	int first = size;
+	bool found = false;
+	for (int hits = frustum_test(node, frustum, t_max, bound); hits; hits &= hits - 1){
+	    int k = __builtin_ctz(hits);
+	    if (node.child[k] < 0)
+		continue;
+	    if (node.count[k]){
+		uint64_t entered = functions.packet_box(node, k, packet);
+		if (entered){
+		    functions.packet_triangles(&blocks[node.child[k]], node.count[k], entered, packet);
+		    found = true;
+		}
+		continue;
+	    }
+	    int j = size++;
+	    for (; j > first && stack[j - 1].bound < bound[k]; --j)
+		stack[j] = stack[j - 1];
+	    stack[j] = {node.child[k], bound[k]};
+	}
+	if (found)
+	    t_max = *std::max_element(packet.t, packet.t + count);
+    }
+    for (int i = 0; i < count; ++i){
+	t[i] = packet.t[i];
+	id[i] = packet.id[i];
+    }
+}
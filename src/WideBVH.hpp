@@ -0,0 +1,27 @@
+#pragma once
+
+#include <vector>
+
+#include "BVH.hpp"
+#include "Ray.h"
+#include "SIMDIntersect.hpp"
+
+// the scene's binary BVH collapsed into eight wide nodes for tracing on the
+// host. small subtrees become leaves so their triangles fill whole blocks.
+class WideBVH{
+private:
+    int collapse(const BVH& bvh, int root);
+    void add_leaf(const BVH& bvh, int root, WideNode& node, int slot);
+    void gather(const BVH& bvh, int root, std::vector<int>& ids);
+    std::vector<int> sizes; // triangles under each node of the binary BVH
+    IntersectFunctions functions;
+public:
+    std::vector<WideNode> nodes;
+    std::vector<TriangleBlock> blocks;
+    WideBVH(const BVH& bvh, ISA isa);
+    WideBVH(){}
+    // closest hit, t and the index in BVH::ordered of what it hit
+    bool intersect(const Ray& ray, float& t, int& id) const;
+    // closest hits of up to PACKET_SIZE coherent rays, id is -1 for a miss
+    void intersect_packet(const Ray* rays, int count, float* t, int* id) const;
+};
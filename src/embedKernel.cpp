@@ -0,0 +1,16 @@
+#include <iostream>
+#include <string>
+
+#include "KernelSource.hpp"
+
+// print a header holding the expanded kernel source so the renderer
+// doesn't need to find src/ at runtime
+int main(int argc, char** argv){
+    if (argc != 2){
+        std::cerr << "Usage: " << argv[0] << " <kernel.cl>" << std::endl;
+        return 1;
+    }
+    std::cout << "// generated from " << argv[1] << " by embedKernel" << std::endl;
+    std::cout << "static const char* embedded_kernel_source = R\"kernel(" << expand_includes(argv[1]) << ")kernel\";" << std::endl;
+    return 0;
+}
@@ -1,3 +1,5 @@
+#include <cmath>
+
 #include "float3.h"
 
 float dot(float3 a, float3 b){
@@ -15,3 +17,33 @@ float3 operator*(float s, float3 v){
 float3 operator+(float3 a, float3 b){
     return {a.x+b.x, a.y+b.y, a.z+b.z}; 
 }
+
+float3 operator-(float3 a, float3 b){
+    return {a.x-b.x, a.y-b.y, a.z-b.z};
+}
+
+float3 operator-(float3 v){
+    return {-v.x, -v.y, -v.z};
+}
+
+// componentwise, like the OpenCL vector types
+float3 operator*(float3 a, float3 b){
+    return {a.x*b.x, a.y*b.y, a.z*b.z};
+}
+
+float3 operator/(float3 a, float3 b){
+    return {a.x/b.x, a.y/b.y, a.z/b.z};
+}
+
+float3& operator+=(float3& a, float3 b){
+    a = a + b;
+    return a;
+}
+
+float length(float3 v){
+    return sqrt(dot(v,v));
+}
+
+float3 normalize(float3 v){
+    return (1/length(v))*v;
+}
@@ -1,10 +1,17 @@
 #pragma once
 
 #ifdef __cplusplus
-#include <CL/cl.hpp>
+#include <CL/cl_platform.h>
 using float3 = cl_float3;
 float dot(float3 a, float3 b);
 float3 cross(float3 a, float3 b);
 float3 operator*(float s, float3 v);
 float3 operator+(float3 a, float3 b);
+float3 operator-(float3 a, float3 b);
+float3 operator-(float3 v);
+float3 operator*(float3 a, float3 b);
+float3 operator/(float3 a, float3 b);
+float3& operator+=(float3& a, float3 b);
+float length(float3 v);
+float3 normalize(float3 v);
 #endif
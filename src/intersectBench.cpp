@@ -0,0 +1,199 @@
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "float3.h"
+#include "Ray.h"
+#include "RaySort.hpp"
+#include "Scene.hpp"
+#include "SIMDIntersect.hpp"
+#include "WideBVH.hpp"
+
+// measures the host intersection code at every ISA level this cpu supports:
+// one ray against the eight boxes of a node, against blocks of triangles,
+// whole closest hit traversals of the scene, and the camera rays of a
+// 512x384 image traced one at a time and in 8x8 packets. then the diffuse
+// bounces off what those camera rays hit are traced in pixel order and
+// sorted by origin and direction.
+//
+// usage: intersectBench [scene] [rays]
+
+double seconds_since(std::chrono::time_point<std::chrono::system_clock> start){
+    return std::chrono::duration<double>(std::chrono::system_clock::now() - start).count();
+}
+
+int main(int argc, char** argv){
+    std::string scene_file = argc > 1 ? argv[1] : "cornel_box.scene";
+    int num_rays = argc > 2 ? std::stoi(argv[2]) : 200000;
+    const long box_calls = 4000000;
+    const long triangle_calls = 2000000;
+
+    Scene scene(scene_file);
+    scene.build_bvh();
+
+    // rays start anywhere in the scene's bounds and point anywhere
+    const GPU_BVHnode& root = scene.bvh.GPU_BVH[0];
+    std::mt19937 gen(1234);
+    std::uniform_real_distribution<float> uniform(0, 1);
+    std::vector<Ray> rays(num_rays);
+    std::vector<RayData> data(num_rays);
+    for (int i = 0; i < num_rays; ++i){
+	float3 o = {uniform(gen), uniform(gen), uniform(gen)};
+	float3 d = {uniform(gen) - 0.5f, uniform(gen) - 0.5f, uniform(gen) - 0.5f};
+	rays[i].origin = root.min + (o*(root.max - root.min));
+	rays[i].direction = normalize(d);
+	data[i].origin = rays[i].origin;
+	data[i].direction = rays[i].direction;
+	data[i].inv_direction = {1/rays[i].direction.x, 1/rays[i].direction.y, 1/rays[i].direction.z};
+    }
+
+    // pinhole camera rays through pixel centres, ordered 8x8 block by block
+    const int width = 512;
+    const int height = 384;
+    float3 w = normalize(scene.camera.location - scene.camera.looking_at);
+    float3 u = cross({0,1,0}, w);
+    float3 v = cross(w, u);
+    float screen_height = tan(scene.camera.aperture/2);
+    float screen_width = screen_height*width/height;
+    std::vector<Ray> primary;
+    for (int by = 0; by < height; by += 8)
+	for (int bx = 0; bx < width; bx += 8)
+	    for (int y = by; y < by + 8; ++y)
+		for (int x = bx; x < bx + 8; ++x){
+		    float sx = (2*(x + 0.5f)/width - 1)*screen_width;
+		    float sy = (2*(y + 0.5f)/height - 1)*screen_height;
+		    Ray ray;
+		    ray.origin = scene.camera.location;
+		    ray.direction = normalize(sx*u + sy*v - w);
+		    primary.push_back(ray);
+		}
+
+    // one diffuse bounce for every camera ray that hits, in pixel order
+    std::vector<Ray> secondary;
+    {
+	WideBVH bvh(scene.bvh, ISA_SCALAR);
+	for (const Ray& ray : primary){
+	    float t;
+	    int id;
+	    if (!bvh.intersect(ray, t, id))
+		continue;
+	    const Triangle& tri = scene.bvh.ordered[id];
+	    float3 n = normalize(cross(tri.vert1 - tri.vert0, tri.vert2 - tri.vert0));
+	    if (dot(n, ray.direction) > 0)
+		n = -n;
+	    float3 d;
+	    do{
+		d = {2*uniform(gen) - 1, 2*uniform(gen) - 1, 2*uniform(gen) - 1};
+	    } while (dot(d, d) > 1 || dot(d, d) < 1e-6f);
+	    Ray bounce;
+	    bounce.origin = ray.origin + t*ray.direction + 0.0001f*n;
+	    bounce.direction = normalize(n + normalize(d));
+	    secondary.push_back(bounce);
+	}
+    }
+
+    std::cout << "Triangles: " << scene.bvh.ordered.size() << ", rays: " << num_rays << std::endl;
+    std::cout << std::left << std::setw(8) << "ISA" << std::right
+	      << std::setw(16) << "box tests/s" << std::setw(20) << "triangle tests/s" << std::setw(14) << "rays/s"
+	      << std::setw(18) << "primary single" << std::setw(18) << "primary packet" << std::setw(10) << "speedup" << std::endl;
+    std::cout << std::fixed << std::setprecision(1);
+    for (int level = ISA_SCALAR; level <= best_isa(); ++level){
+	ISA isa = (ISA)level;
+	IntersectFunctions functions = intersect_functions(isa);
+	WideBVH bvh(scene.bvh, isa);
+	long found = 0; // keeps the tests from being optimized away
+	float dist[WIDTH];
+
+	std::chrono::time_point<std::chrono::system_clock> start = std::chrono::system_clock::now();
+	for (long i = 0; i < box_calls; ++i)
+	    found += functions.boxes(bvh.nodes[i % bvh.nodes.size()], data[i % num_rays], 1e20, dist);
+	double box_rate = box_calls*WIDTH/seconds_since(start);
+
+	start = std::chrono::system_clock::now();
+	for (long i = 0; i < triangle_calls; ++i){
+	    float t = 1e20;
+	    int id = -1;
+	    functions.triangles(&bvh.blocks[i % bvh.blocks.size()], 1, data[i % num_rays], t, id);
+	    found += id;
+	}
+	double triangle_rate = triangle_calls*WIDTH/seconds_since(start);
+
+	start = std::chrono::system_clock::now();
+	for (int i = 0; i < num_rays; ++i){
+	    float t;
+	    int id;
+	    found += bvh.intersect(rays[i], t, id);
+	}
+	double ray_rate = num_rays/seconds_since(start);
+
+	start = std::chrono::system_clock::now();
+	for (const Ray& ray : primary){
+	    float t;
+	    int id;
+	    found += bvh.intersect(ray, t, id);
+	}
+	double single_rate = primary.size()/seconds_since(start);
+
+	start = std::chrono::system_clock::now();
+	for (size_t i = 0; i < primary.size(); i += PACKET_SIZE){
+	    float t[PACKET_SIZE];
+	    int id[PACKET_SIZE];
+	    bvh.intersect_packet(&primary[i], PACKET_SIZE, t, id);
+	    found += id[0];
+	}
+	double packet_rate = primary.size()/seconds_since(start);
+
+	std::cout << std::left << std::setw(8) << isa_name(isa) << std::right
+		  << std::setw(14) << box_rate/1e6 << " M" << std::setw(18) << triangle_rate/1e6 << " M"
+		  << std::setw(12) << ray_rate/1e6 << " M" << std::setw(16) << single_rate/1e6 << " M"
+		  << std::setw(16) << packet_rate/1e6 << " M" << std::setw(9) << packet_rate/single_rate << "x"
+		  << (found == 42 ? " " : "") << std::endl;
+    }
+
+    std::cout << std::endl << "Secondary rays: " << secondary.size() << std::endl;
+    std::cout << std::left << std::setw(8) << "ISA" << std::right
+	      << std::setw(18) << "unsorted rays/s" << std::setw(16) << "sorted rays/s"
+	      << std::setw(18) << "with sort rays/s" << std::setw(12) << "sort time" << std::setw(10) << "speedup" << std::endl;
+    for (int level = ISA_SCALAR; level <= best_isa(); ++level){
+	ISA isa = (ISA)level;
+	WideBVH bvh(scene.bvh, isa);
+	long found = 0;
+
+	std::chrono::time_point<std::chrono::system_clock> start = std::chrono::system_clock::now();
+	for (const Ray& ray : secondary){
+	    float t;
+	    int id;
+	    found += bvh.intersect(ray, t, id);
+	}
+	double unsorted_rate = secondary.size()/seconds_since(start);
+
+	// rays are gathered into sorted order as a queue of pending rays would be
+	start = std::chrono::system_clock::now();
+	std::vector<int> order;
+	sort_rays(secondary.data(), secondary.size(), root.min, root.max, order);
+	std::vector<Ray> sorted(secondary.size());
+	for (size_t i = 0; i < order.size(); ++i)
+	    sorted[i] = secondary[order[i]];
+	double sort_time = seconds_since(start);
+
+	start = std::chrono::system_clock::now();
+	for (const Ray& ray : sorted){
+	    float t;
+	    int id;
+	    found += bvh.intersect(ray, t, id);
+	}
+	double trace_time = seconds_since(start);
+	double sorted_rate = sorted.size()/trace_time;
+	double total_rate = sorted.size()/(sort_time + trace_time);
+
+	std::cout << std::left << std::setw(8) << isa_name(isa) << std::right
+		  << std::setw(16) << unsorted_rate/1e6 << " M" << std::setw(14) << sorted_rate/1e6 << " M"
+		  << std::setw(16) << total_rate/1e6 << " M" << std::setw(9) << sort_time*1e3 << " ms"
+		  << std::setw(9) << total_rate/unsorted_rate << "x" << (found == 42 ? " " : "") << std::endl;
+    }
+    return 0;
+}
@@ -1,35 +1,69 @@
+#include <algorithm>
 #include <chrono>
+#include <future>
 #include <iostream>
+#include <memory>
+#include <sstream>
 #include <string>
+#include <thread>
 
 #include <cstring>
 
+#ifndef CPU_ONLY
+#include "CLRenderer.hpp"
+#endif
+#include "CPURenderer.hpp"
 #include "Renderer.hpp"
+#include "RenderOptions.h"
 #include "Scene.hpp"
+#include "Tonemap.hpp"
 
 void usage(std::string executable){
     std::cout << "Usage: " << executable << " [options]" << std::endl;
     std::cout << "Options:" << std::endl;
+    std::cout << "  -b <num>            Follow paths for at most <num> bounces." << std::endl;
+    std::cout << "  -e <error>          Stop sampling pixels once their relative error is below <error>." << std::endl;
     std::cout << "  -i <file>           Render scene described in <file>." << std::endl;
     std::cout << "  -h                  Display this message." << std::endl;
-    std::cout << "  -o <file>           Save the output image to <file>." << std::endl;
+    std::cout << "  -m <file>           Save a map of the samples taken for each pixel to <file>." << std::endl;
+    std::cout << "  -o <file>           Save the output image to <file>, as png, ppm, pfm or exr by its extension." << std::endl;
     std::cout << "  -p <num>            Trace a maximum of <num> paths for each pixel." << std::endl;
     std::cout << "  -r <radius>         Apply bloom of radius <radius>." << std::endl;
     std::cout << "  -s <width>x<height> Output an image with the given resolution." << std::endl;
+    std::cout << "  -t <size>           Render in tiles of <size>x<size> pixels." << std::endl;
+    std::cout << "  --time-limit <sec>  Render for <sec> seconds. Only limited by -p if it is given." << std::endl;
+    std::cout << "  --preview <file>    Save what has been rendered so far to <file> while rendering." << std::endl;
+    std::cout << "  --preview-interval <sec> Seconds between previews. Defaults to 10." << std::endl;
+    std::cout << "  --snapshots <n,...> Also save the image as it is at each of these samples per pixel, next to -o." << std::endl;
+    std::cout << "  --snapshot-interval <sec> Also save the image every <sec> seconds, next to -o." << std::endl;
+    std::cout << "  --checkpoint <file> Save the state of the render to <file> now and then, and when stopped by a signal." << std::endl;
+    std::cout << "  --checkpoint-interval <sec> Seconds between checkpoints. Defaults to 300." << std::endl;
+    std::cout << "  --resume            Carry on from the checkpoint file." << std::endl;
+    std::cout << "  --sample-range <a>:<b> Take samples <a> up to <b> of every pixel, for --accumulate." << std::endl;
+    std::cout << "  --accumulate <file> Save the sums of the samples to <file> for bin/merge instead of an image." << std::endl;
+    std::cout << "  --backend=<name>    Render with opencl (default) or cpu." << std::endl;
+    std::cout << "  --threads <num>     Use <num> threads on the host. Defaults to one per core." << std::endl;
+    std::cout << "  --denoise           Filter the noise out of the image, guided by what the camera rays hit." << std::endl;
+    std::cout << "  --aov <file>        Save depth, normals, albedo, direct and indirect light, material IDs and sample counts to <file> as EXR layers." << std::endl;
+    std::cout << "  --stream            Render in bands of rows and write each to the output file as it finishes." << std::endl;
+    std::cout << "  --half              Store an EXR output image as 16 bit floats." << std::endl;
+    std::cout << "  --tonemap <name>    Map colours to the screen with gamma (default), srgb, reinhard or aces." << std::endl;
+    std::cout << "  --cache-dir <dir>   Keep compiled kernels in <dir>. Defaults to .kernel_cache" << std::endl;
+    std::cout << "  --no-cache          Always compile the kernel from source." << std::endl;
     exit(0);
 }
 
 int main(int argc, char** argv){
-    std::string save_file = "test.png";
     std::string scene_file = "cornel_box.scene";
-    int samples = 100;
-    int width = 512;
-    int height = 384;
-    int radius = 1;
+    RenderOptions options;
+    bool samples_given = false;
+#ifdef CPU_ONLY
+    options.backend = "cpu";
+#endif
     for (int i = 1; i< argc; ++i){
 	if (strcmp(argv[i], "-o") == 0){
 	    if (i+1 < argc){
-		save_file = std::string(argv[i+1]);
+		options.output_file = std::string(argv[i+1]);
 		++i;
 	    }
 	    else{
@@ -37,6 +71,26 @@ int main(int argc, char** argv){
 		usage(argv[0]);
 	    }
 	}
+	if (strcmp(argv[i], "-b") == 0){
+	    if (i+1 < argc){
+		options.max_bounces = atoi(argv[i+1]);
+		++i;
+	    }
+	    else{
+		std::cout << "No bounce count specified" << std::endl;
+		usage(argv[0]);
+	    }
+	}
+	if (strcmp(argv[i], "-e") == 0){
+	    if (i+1 < argc){
+		options.target_error = atof(argv[i+1]);
+		++i;
+	    }
+	    else{
+		std::cout << "No target error specified" << std::endl;
+		usage(argv[0]);
+	    }
+	}
 	if (strcmp(argv[i], "-h") == 0){
 	    usage(argv[0]);
 	}
@@ -50,9 +104,20 @@ int main(int argc, char** argv){
 		usage(argv[0]);
 	    }
 	}
+	if (strcmp(argv[i], "-m") == 0){
+	    if (i+1 < argc){
+		options.sample_map = std::string(argv[i+1]);
+		++i;
+	    }
+	    else{
+		std::cout << "No sample map file specified" << std::endl;
+		usage(argv[0]);
+	    }
+	}
 	if (strcmp(argv[i], "-p") == 0){
 	    if (i+1 < argc){
-		samples = atoi(argv[i+1]);
+		options.samples = atoi(argv[i+1]);
+		samples_given = true;
 		++i;
 	    }
 	    else{
@@ -62,7 +127,7 @@ int main(int argc, char** argv){
 	}
 	if (strcmp(argv[i], "-r") == 0){
 	    if(i+1 < argc){
-		radius = atoi(argv[i+1]);
+		options.bloom_rad = atoi(argv[i+1]);
 		++i;
 	    }
 	    else{
@@ -70,11 +135,175 @@ int main(int argc, char** argv){
 		usage(argv[0]);
 	    }
 	}
+	if (strcmp(argv[i], "-t") == 0){
+	    if (i+1 < argc){
+		options.tile_size = atoi(argv[i+1]);
+		++i;
+	    }
+	    else{
+		std::cout << "No tile size specified" << std::endl;
+		usage(argv[0]);
+	    }
+	}
+	if (strcmp(argv[i], "--time-limit") == 0){
+	    if (i+1 < argc){
+		options.time_limit = atof(argv[i+1]);
+		++i;
+	    }
+	    else{
+		std::cout << "No time limit specified" << std::endl;
+		usage(argv[0]);
+	    }
+	}
+	if (strcmp(argv[i], "--preview") == 0){
+	    if (i+1 < argc){
+		options.preview_file = std::string(argv[i+1]);
+		++i;
+	    }
+	    else{
+		std::cout << "No preview file specified" << std::endl;
+		usage(argv[0]);
+	    }
+	}
+	if (strcmp(argv[i], "--preview-interval") == 0){
+	    if (i+1 < argc){
+		options.preview_interval = atof(argv[i+1]);
+		++i;
+	    }
+	    else{
+		std::cout << "No preview interval specified" << std::endl;
+		usage(argv[0]);
+	    }
+	}
+	if (strcmp(argv[i], "--snapshots") == 0){
+	    if (i+1 < argc){
+		std::stringstream counts(argv[i+1]);
+		std::string count;
+		while (std::getline(counts, count, ','))
+		    options.snapshots.push_back(atoi(count.c_str()));
+		++i;
+	    }
+	    else{
+		std::cout << "No snapshot sample counts specified" << std::endl;
+		usage(argv[0]);
+	    }
+	}
+	if (strcmp(argv[i], "--snapshot-interval") == 0){
+	    if (i+1 < argc){
+		options.snapshot_interval = atof(argv[i+1]);
+		++i;
+	    }
+	    else{
+		std::cout << "No snapshot interval specified" << std::endl;
+		usage(argv[0]);
+	    }
+	}
+	if (strcmp(argv[i], "--checkpoint") == 0){
+	    if (i+1 < argc){
+		options.checkpoint_file = std::string(argv[i+1]);
+		++i;
+	    }
+	    else{
+		std::cout << "No checkpoint file specified" << std::endl;
+		usage(argv[0]);
+	    }
+	}
+	if (strcmp(argv[i], "--checkpoint-interval") == 0){
+	    if (i+1 < argc){
+		options.checkpoint_interval = atof(argv[i+1]);
+		++i;
+	    }
+	    else{
+		std::cout << "No checkpoint interval specified" << std::endl;
+		usage(argv[0]);
+	    }
+	}
+	if (strcmp(argv[i], "--resume") == 0){
+	    options.resume = true;
+	}
+	if (strcmp(argv[i], "--sample-range") == 0){
+	    if (i+1 < argc){
+		std::string range(argv[i+1]);
+		options.first_sample = atoi(range.substr(0, range.find(":")).c_str());
+		options.samples = atoi(range.substr(range.find(":") + 1).c_str()) - options.first_sample;
+		samples_given = true;
+		++i;
+	    }
+	    else{
+		std::cout << "No sample range specified" << std::endl;
+		usage(argv[0]);
+	    }
+	}
+	if (strcmp(argv[i], "--accumulate") == 0){
+	    if (i+1 < argc){
+		options.accumulate_file = std::string(argv[i+1]);
+		++i;
+	    }
+	    else{
+		std::cout << "No accumulation file specified" << std::endl;
+		usage(argv[0]);
+	    }
+	}
+	if (strncmp(argv[i], "--backend=", 10) == 0){
+	    options.backend = std::string(argv[i] + 10);
+	}
+	if (strcmp(argv[i], "--threads") == 0){
+	    if (i+1 < argc){
+		options.threads = atoi(argv[i+1]);
+		++i;
+	    }
+	    else{
+		std::cout << "No thread count specified" << std::endl;
+		usage(argv[0]);
+	    }
+	}
+	if (strcmp(argv[i], "--denoise") == 0){
+	    options.denoise = true;
+	}
+	if (strcmp(argv[i], "--aov") == 0){
+	    if (i+1 < argc){
+		options.aov_file = std::string(argv[i+1]);
+		++i;
+	    }
+	    else{
+		std::cout << "No AOV file specified" << std::endl;
+		usage(argv[0]);
+	    }
+	}
+	if (strcmp(argv[i], "--stream") == 0){
+	    options.stream = true;
+	}
+	if (strcmp(argv[i], "--half") == 0){
+	    options.half = true;
+	}
+	if (strcmp(argv[i], "--tonemap") == 0){
+	    if (i+1 < argc){
+		options.tonemap = std::string(argv[i+1]);
+		++i;
+	    }
+	    else{
+		std::cout << "No tonemapping operator specified" << std::endl;
+		usage(argv[0]);
+	    }
+	}
+	if (strcmp(argv[i], "--cache-dir") == 0){
+	    if (i+1 < argc){
+		options.cache_dir = std::string(argv[i+1]);
+		++i;
+	    }
+	    else{
+		std::cout << "No cache directory specified" << std::endl;
+		usage(argv[0]);
+	    }
+	}
+	if (strcmp(argv[i], "--no-cache") == 0){
+	    options.cache_dir = "";
+	}
 	if (strcmp(argv[i], "-s") == 0){
 	    if (i+1 < argc){
 		std::string res(argv[i+1]);
-		width = std::stoi(res.substr(0,res.find("x")));
-		height = std::stoi(res.substr(res.find("x") + 1));
+		options.width = std::stoi(res.substr(0,res.find("x")));
+		options.height = std::stoi(res.substr(res.find("x") + 1));
 
 		++i;
 	    }
@@ -85,25 +314,120 @@ int main(int argc, char** argv){
 	}
     }
 
+    std::sort(options.snapshots.begin(), options.snapshots.end());
+    options.snapshots.erase(std::unique(options.snapshots.begin(), options.snapshots.end()), options.snapshots.end());
+    if (!options.snapshots.empty() && options.snapshots[0] <= 0){
+	std::cout << "Need positive sample counts for snapshots" << std::endl;
+	usage(argv[0]);
+    }
+    if (options.snapshot_interval < 0){
+	std::cout << "Need a positive snapshot interval" << std::endl;
+	usage(argv[0]);
+    }
+    // without -p the render goes on to the last snapshot
+    if (!options.snapshots.empty() && !samples_given)
+	options.samples = options.snapshots.back();
+    if (options.time_limit > 0 && !samples_given)
+	options.samples = 0;
+    if (options.max_bounces <= 0){
+	std::cout << "Need a positive number of bounces" << std::endl;
+	usage(argv[0]);
+    }
+    if (options.samples <= 0 && options.time_limit <= 0){
+	std::cout << "Need a positive number of samples" << std::endl;
+	usage(argv[0]);
+    }
+#ifdef CPU_ONLY
+    if (options.backend != "cpu"){
+	std::cout << "Built without OpenCL, only the cpu backend is available" << std::endl;
+	usage(argv[0]);
+    }
+#else
+    if (options.backend != "opencl" && options.backend != "cpu"){
+	std::cout << "Unknown backend " << options.backend << std::endl;
+	usage(argv[0]);
+    }
+#endif
+    if (options.stream && (options.denoise || !options.aov_file.empty() || !options.sample_map.empty() || !options.preview_file.empty()
+			   || !options.snapshots.empty() || options.snapshot_interval > 0 || !options.checkpoint_file.empty())){
+	std::cout << "--stream can't be used with --denoise, --aov, -m, --preview, snapshots or checkpoints, they need the whole image" << std::endl;
+	usage(argv[0]);
+    }
+    // the same samples have to come out of every process, whatever else it
+    // was given, so nothing can depend on time or on the noise so far
+    if (!options.accumulate_file.empty() && (options.backend != "cpu" || options.target_error > 0 || options.time_limit > 0 || options.stream
+					     || options.denoise || !options.aov_file.empty() || !options.checkpoint_file.empty())){
+	std::cout << "--accumulate needs --backend=cpu and can't be used with -e, --time-limit, --stream, --denoise, --aov or checkpoints" << std::endl;
+	usage(argv[0]);
+    }
+    if (options.first_sample < 0 || (options.first_sample > 0 && options.accumulate_file.empty())){
+	std::cout << "--sample-range needs a range from 0 or up and --accumulate to save it to" << std::endl;
+	usage(argv[0]);
+    }
+    if (options.resume && options.checkpoint_file.empty()){
+	std::cout << "--resume needs the --checkpoint file to carry on from" << std::endl;
+	usage(argv[0]);
+    }
+    if (!Tonemapper::exists(options.tonemap)){
+	std::cout << "Unknown tonemapping operator " << options.tonemap << std::endl;
+	usage(argv[0]);
+    }
+
     std::chrono::time_point<std::chrono::system_clock> t0,t1,t2,t3;
+    std::chrono::time_point<std::chrono::system_clock> parsed_time, bvh_time, ready_time, build_time;
 
     t0 = std::chrono::system_clock::now();
 
+    // OpenCL setup doesn't need the scene and the kernel build only needs the
+    // materials and camera, so both run while the scene loads and the BVH builds
+    std::unique_ptr<Renderer> renderer;
+    std::promise<const Scene*> parsed;
+    std::future<const Scene*> parsed_scene = parsed.get_future();
+    std::thread init([&](){
+#ifndef CPU_ONLY
+	if (options.backend == "opencl")
+	    renderer.reset(new CLRenderer("src/render_kernel.cl", options));
+	else
+#endif
+	    renderer.reset(new CPURenderer(options));
+	ready_time = std::chrono::system_clock::now();
+	renderer->build(*parsed_scene.get());
+	build_time = std::chrono::system_clock::now();
+    });
+
     Scene scene(scene_file);
-    Renderer renderer("src/render_kernel.cl", width, height, samples, radius);
+    parsed_time = std::chrono::system_clock::now();
+    parsed.set_value(&scene);
+    scene.build_bvh();
+    bvh_time = std::chrono::system_clock::now();
+    init.join();
+
     std::clog << "Image info:" << std::endl;
-    std::clog << "  Width:     " << width << std::endl;
-    std::clog << "  Hieght:    " << height << std::endl;
-    std::clog << "  Samples:   " << samples << std::endl;
+    std::clog << "  Width:     " << options.width << std::endl;
+    std::clog << "  Hieght:    " << options.height << std::endl;
+    if (options.samples > 0)
+	std::clog << "  Samples:   " << options.samples << std::endl;
+    if (options.time_limit > 0)
+	std::clog << "  Time:      " << options.time_limit << "s" << std::endl;
+    if (options.target_error > 0)
+	std::clog << "  Error:     " << options.target_error << std::endl;
     std::clog << "  Triangles: " << scene.bvh.ordered.size() << std::endl;
 
     t1 = std::chrono::system_clock::now();
     
-    renderer.render(scene);
+    renderer->render(scene);
 
     t2 = std::chrono::system_clock::now();
+
+    if (renderer->stopped){
+	std::clog << "Stopped, carry on with --checkpoint " << options.checkpoint_file << " --resume" << std::endl;
+	return 1;
+    }
     
-    renderer.save_image(save_file);
+    if (!options.accumulate_file.empty())
+	renderer->save_accumulation(options.accumulate_file);
+    else
+	renderer->save_image(options.output_file);
 
     t3 = std::chrono::system_clock::now();
 
@@ -124,7 +448,18 @@ int main(int argc, char** argv){
     std::clog << std::endl;
     std::clog << "Initialization time: " << im << "m" << is << "s" << std::endl;
     std::clog << "Render time: " << km << "m" << ks << "s" << std::endl;
-    std::clog << "Post process time: " << pm << "m" << ps << "s" << std::endl;
+    std::clog << "Post process time: " << pm << "m" << ps << "s (" << renderer->encode_time << "s encoding)" << std::endl;
+
+    auto since_start = [&](std::chrono::time_point<std::chrono::system_clock> t){
+	return std::chrono::duration<double>(t - t0).count();
+    };
+    std::clog << "Startup phases (seconds from start):" << std::endl;
+    std::clog << "  Scene parsed:  " << since_start(parsed_time) << std::endl;
+    std::clog << "  BVH built:     " << since_start(bvh_time) << std::endl;
+    std::clog << "  Backend ready: " << since_start(ready_time) << std::endl;
+    if (options.backend == "opencl")
+	std::clog << "  Kernel built:  " << since_start(build_time) << std::endl;
+    std::clog << "  First sample:  " << since_start(renderer->first_sample) << std::endl;
     
     return 0;
 }
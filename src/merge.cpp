@@ -0,0 +1,152 @@
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <cstring>
+
+#include "Accumulation.hpp"
+#include "Bloom.hpp"
+#include "error.hpp"
+#include "float3.h"
+#include "ImageFile.hpp"
+#include "ThreadPool.hpp"
+#include "Tonemap.hpp"
+
+// adds up the accumulation files of renders of disjoint sample ranges of the
+// same scene, then finishes the image the way bin/main does
+
+void usage(std::string executable){
+    std::cout << "Usage: " << executable << " [options] <file>..." << std::endl;
+    std::cout << "Merge accumulation files saved by main --accumulate into one image." << std::endl;
+    std::cout << "Options:" << std::endl;
+    std::cout << "  -h                  Display this message." << std::endl;
+    std::cout << "  -o <file>           Save the merged image to <file>, as png, ppm, pfm or exr by its extension." << std::endl;
+    std::cout << "  -r <radius>         Apply bloom of radius <radius>." << std::endl;
+    std::cout << "  --threads <num>     Use <num> threads. Defaults to one per core." << std::endl;
+    std::cout << "  --half              Store an EXR image as 16 bit floats." << std::endl;
+    std::cout << "  --tonemap <name>    Map colours to the screen with gamma (default), srgb, reinhard or aces." << std::endl;
+    exit(0);
+}
+
+int main(int argc, char** argv){
+    std::string output_file = "test.png";
+    int bloom_rad = 1;
+    int threads = 0;
+    bool half = false;
+    std::string tonemap = "gamma";
+    std::vector<std::string> inputs;
+    for (int i = 1; i < argc; ++i){
+	if (strcmp(argv[i], "-o") == 0){
+	    if (i+1 < argc){
+		output_file = std::string(argv[i+1]);
+		++i;
+	    }
+	    else{
+		std::cout << "No output file specified" << std::endl;
+		usage(argv[0]);
+	    }
+	}
+	else if (strcmp(argv[i], "-r") == 0){
+	    if (i+1 < argc){
+		bloom_rad = atoi(argv[i+1]);
+		++i;
+	    }
+	    else{
+		std::cout << "No bloom radius specified" << std::endl;
+		usage(argv[0]);
+	    }
+	}
+	else if (strcmp(argv[i], "--threads") == 0){
+	    if (i+1 < argc){
+		threads = atoi(argv[i+1]);
+		++i;
+	    }
+	    else{
+		std::cout << "No thread count specified" << std::endl;
+		usage(argv[0]);
+	    }
+	}
+	else if (strcmp(argv[i], "--half") == 0)
+	    half = true;
+	else if (strcmp(argv[i], "--tonemap") == 0){
+	    if (i+1 < argc){
+		tonemap = std::string(argv[i+1]);
+		++i;
+	    }
+	    else{
+		std::cout << "No tonemapping operator specified" << std::endl;
+		usage(argv[0]);
+	    }
+	}
+	else if (strcmp(argv[i], "-h") == 0)
+	    usage(argv[0]);
+	else
+	    inputs.push_back(argv[i]);
+    }
+    if (inputs.empty()){
+	std::cout << "No accumulation files to merge" << std::endl;
+	usage(argv[0]);
+    }
+    if (!Tonemapper::exists(tonemap)){
+	std::cout << "Unknown tonemapping operator " << tonemap << std::endl;
+	usage(argv[0]);
+    }
+
+    std::vector<Accumulation> parts(inputs.size());
+    for (size_t i = 0; i < inputs.size(); ++i){
+	if (!parts[i].load(inputs[i]))
+	    print_error("Unable to read accumulation file " + inputs[i]);
+	const Accumulation& first = parts[0];
+	if (parts[i].scene_hash != first.scene_hash || parts[i].width != first.width || parts[i].height != first.height
+	    || parts[i].max_bounces != first.max_bounces)
+	    print_error(inputs[i] + " is of another scene, size or bounce limit than " + inputs[0]);
+    }
+
+    // the ranges can't overlap or some samples would count twice. gaps only
+    // leave the image with fewer samples
+    std::vector<int> order(parts.size());
+    for (size_t i = 0; i < order.size(); ++i)
+	order[i] = i;
+    std::sort(order.begin(), order.end(), [&](int a, int b){return parts[a].first_sample < parts[b].first_sample;});
+    int end = 0;
+    for (int i : order){
+	if (parts[i].first_sample < end)
+	    print_error("Sample range of " + inputs[i] + " overlaps another file");
+	if (parts[i].first_sample > end)
+	    print_warning("Samples " + std::to_string(end) + " to " + std::to_string(parts[i].first_sample) + " aren't in any file");
+	end = parts[i].end_sample;
+    }
+
+    const int width = parts[0].width;
+    const int height = parts[0].height;
+    const long pixels = (long)width*height;
+    std::vector<int64_t> sums(3*pixels, 0);
+    std::vector<long> counts(pixels, 0);
+    for (const Accumulation& part : parts){
+	for (long i = 0; i < 3*pixels; ++i)
+	    sums[i] += part.sums[i];
+	for (long i = 0; i < pixels; ++i)
+	    counts[i] += part.counts[i];
+    }
+    std::vector<float3> image(pixels);
+    for (long i = 0; i < pixels; ++i){
+	double scale = counts[i] ? 1/(FIXED_POINT_ONE*counts[i]) : 0;
+	image[i] = {(float)(sums[3*i]*scale), (float)(sums[3*i + 1]*scale), (float)(sums[3*i + 2]*scale)};
+    }
+    std::clog << "Merged " << parts.size() << " files of " << width << "x" << height << " pixels, up to sample " << end << std::endl;
+
+    ThreadPool pool(threads);
+    bloom(image, width, height, bloom_rad, pool);
+    ImageWriter writer(output_file, width, height, pool, half);
+    if (writer.floats())
+	writer.write(image.data(), height);
+    else{
+	std::vector<unsigned char> rgba;
+	Tonemapper(tonemap).apply(image, rgba, pool);
+	writer.write(rgba.data(), height);
+    }
+    if (!writer.finish())
+	print_error("Unable to save image to " + output_file);
+    return 0;
+}
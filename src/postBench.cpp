@@ -0,0 +1,81 @@
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "Bloom.hpp"
+#include "float3.h"
+#include "ThreadPool.hpp"
+#include "Tonemap.hpp"
+
+// measures the post process on its own: bloom, then every tonemapping
+// operator, against the per pixel pow the image used to be packed with. the
+// image is synthetic, mostly below white with a few hot spots for the bloom.
+//
+// usage: postBench [width] [height] [radius] [threads]
+
+double seconds_since(std::chrono::time_point<std::chrono::system_clock> start){
+    return std::chrono::duration<double>(std::chrono::system_clock::now() - start).count();
+}
+
+inline float clamp(float x){return x<0.0? 0.0: x>1.0 ? 1.0 : x;}
+inline int to_int(float x){return int(pow(clamp(x), 1/2.2)*255 + 0.5);}
+
+int main(int argc, char** argv){
+    int width = argc > 1 ? std::stoi(argv[1]) : 3840;
+    int height = argc > 2 ? std::stoi(argv[2]) : 2160;
+    int radius = argc > 3 ? std::stoi(argv[3]) : 50;
+    int threads = argc > 4 ? std::stoi(argv[4]) : 0;
+    const int repeats = 5;
+    const long pixels = (long)width*height;
+
+    std::mt19937 gen(1234);
+    std::exponential_distribution<float> light(4);
+    std::uniform_real_distribution<float> uniform(0, 1);
+    std::vector<float3> image(pixels);
+    for (long i = 0; i < pixels; ++i){
+	float boost = uniform(gen) < 0.001f ? 50 : 1;
+	image[i] = {boost*light(gen), boost*light(gen), boost*light(gen)};
+    }
+
+    ThreadPool pool(threads);
+    std::cout << width << "x" << height << ", bloom radius " << radius << ", " << pool.size() << " threads" << std::endl;
+    std::cout << std::left << std::setw(12) << "stage" << std::right << std::setw(12) << "time" << std::setw(16) << "pixels/s" << std::endl;
+    std::cout << std::fixed << std::setprecision(2);
+    auto report = [&](std::string stage, double seconds){
+	std::cout << std::left << std::setw(12) << stage << std::right
+		  << std::setw(9) << seconds*1e3 << " ms" << std::setw(14) << pixels/seconds/1e6 << " M" << std::endl;
+    };
+
+    std::vector<float3> bloomed = image;
+    std::chrono::time_point<std::chrono::system_clock> start = std::chrono::system_clock::now();
+    bloom(bloomed, width, height, radius, pool);
+    report("bloom", seconds_since(start));
+
+    std::vector<unsigned char> reference(4*pixels);
+    start = std::chrono::system_clock::now();
+    for (int r = 0; r < repeats; ++r)
+	for (long i = 0; i < pixels; ++i){
+	    reference[4*i + 0] = to_int(bloomed[i].x);
+	    reference[4*i + 1] = to_int(bloomed[i].y);
+	    reference[4*i + 2] = to_int(bloomed[i].z);
+	    reference[4*i + 3] = 255;
+	}
+    report("pow", seconds_since(start)/repeats);
+
+    const char* names[] = {"gamma", "srgb", "reinhard", "aces"};
+    for (const char* name : names){
+	Tonemapper tonemapper(name);
+	std::vector<unsigned char> rgba;
+	start = std::chrono::system_clock::now();
+	for (int r = 0; r < repeats; ++r)
+	    tonemapper.apply(bloomed, rgba, pool);
+	report(name, seconds_since(start)/repeats);
+	if (std::string(name) == "gamma" && rgba != reference)
+	    std::cout << "  gamma table differs from pow" << std::endl;
+    }
+    return 0;
+}
@@ -1,5 +1,7 @@
 #include "Box.h"
 #include "Camera.h"
+#include "EnvSample.h"
+#include "Features.h"
 #include "GPU_BVHnode.h"
 #include "Material.h"
 #include "Ray.h"
@@ -7,23 +9,62 @@
 
 #define RAND_MAX (0x800000U)
 
+// the host describes the scene with these so paths it can't take compile
+// away. without them every feature is built in.
+#ifndef HAS_LAMBERTIAN
+#define HAS_LAMBERTIAN 1
+#endif
+#ifndef HAS_COOK_TORRANCE
+#define HAS_COOK_TORRANCE 1
+#endif
+#ifndef HAS_REFRACTION
+#define HAS_REFRACTION 1
+#endif
+#ifndef HAS_LENS
+#define HAS_LENS 1
+#endif
+#ifndef MAX_BOUNCES
+#define MAX_BOUNCES 10
+#endif
+// accumulate the first hit of every path for the denoiser
+#ifndef HAS_FEATURES
+#define HAS_FEATURES 0
+#endif
+// accumulate direct light and keep the first material hit for the AOVs
+#ifndef HAS_AOVS
+#define HAS_AOVS 0
+#endif
+// light escaped paths with an environment map rather than the sky gradient,
+// aiming diffuse bounces at its bright parts
+#ifndef HAS_ENVMAP
+#define HAS_ENVMAP 0
+#endif
+
 typedef struct _dat{
     float t;
     float3 normal;
     int mat;
 } HitData;
 
-//copied from http://cas.ee.ic.ac.uk/people/dt10/research/rngs-gpu-mwc64x.html
+// counter based generator, every random number is a hash of the pixel, the
+// sample and how many numbers that sample has drawn. nothing has to be stored
+// between launches and a sample comes out the same however the work is split.
+// hash from Jarzynski and Olano, "Hash Functions for GPU Rendering"
+uint pcg_hash(uint v){
+    uint state = v*747796405U + 2891336453U;
+    uint word = ((state >> ((state >> 28U) + 4U)) ^ state)*277803737U;
+    return (word >> 22U) ^ word;
+}
+
+// state is (key for this pixel and sample, dimension)
+uint2 rand_init(uint pixel, uint sample){
+    return (uint2)(pcg_hash(pixel ^ pcg_hash(sample)), 0);
+}
+
 uint rand(uint2* state){
-    enum { A=4294883355U};
-    uint x=(*state).x, c=(*state).y;  // Unpack the state
-    uint res=x^c;                     // Calculate the result
-    uint hi=mul_hi(x,A);              // Step the RNG
-    x=x*A+c;
-    c=hi+(x<c);
-    *state=(uint2)(x,c);              // Pack the state back up
-    return res&0x7fffff;              // Return the next result
-                                      // modified to not ever get 1
+    uint res = pcg_hash((*state).x + pcg_hash((*state).y));
+    (*state).y++;
+    return res&0x7fffff; // never get 1
 }
 
 float cosTheta(float3 w){
@@ -65,7 +106,7 @@ float F(float etaI, float etaT, float cosThetaI){
 
 float3 global_to_local(float3 normal, float3 vec){
     float3 z = normal;
-    float3 y = normalize(cross(z,(fabs(z.z - 1) < 0.0001)?(float3)(1,0,0):(float3)(0,0,1)));
+    float3 y = normalize(cross(z,(fabs(fabs(z.z) - 1) < 0.0001)?(float3)(1,0,0):(float3)(0,0,1)));
     float3 x = cross(y,z);
 
     return (float3)(dot(x,vec), dot(y, vec), dot(z,vec));
@@ -73,7 +114,7 @@ float3 global_to_local(float3 normal, float3 vec){
 
 float3 local_to_global(float3 normal, float3 vec){
     float3 z = normal;
-    float3 y = normalize(cross(z,(fabs(z.z - 1) < 0.0001)?(float3)(1,0,0):(float3)(0,0,1)));
+    float3 y = normalize(cross(z,(fabs(fabs(z.z) - 1) < 0.0001)?(float3)(1,0,0):(float3)(0,0,1)));
     float3 x = cross(y,z);
 
     float3 a1 = (float3)(x.x, y.x, z.x);
@@ -83,8 +124,38 @@ float3 local_to_global(float3 normal, float3 vec){
     return (float3)(dot(a1,vec), dot(a2, vec), dot(a3, vec));
 }
 
+float3 sample_lambertian(float3 normal, float phi, float xi, float* bxdf){
+    float costheta = acos(xi)*2/M_PI;
+    float sintheta = sqrt(1-costheta*costheta);
+    *bxdf = costheta*costheta/M_PI*2/sqrt(1-xi*xi);
+    return local_to_global(normal, (float3)(sintheta*cos(phi), sintheta*sin(phi), costheta));
+}
+
+// importance sampling based on pbrt
+float3 sample_cook_torrance(float3 normal, float3 win, Material mat, float phi, float xi, float* bxdf){
+    float tan2theta = -mat.alpha*mat.alpha*log(xi);
+    float costheta = 1/sqrt(1+tan2theta);
+    float sintheta = sqrt(1-costheta*costheta);
+
+    float3 w_half = (float3)(sintheta*cos(phi), sintheta*sin(phi), costheta);
+    if (win.z*w_half.z < 0) w_half = -w_half;
+
+    float3 wout = -win + 2*w_half*dot(win,w_half);
+
+    float cout = cosTheta(wout);
+    float cin = cosTheta(win);
+    if( cout*cin < 0){
+        *bxdf = 0;
+    }
+    else
+        *bxdf = G(win, wout, mat)/cin/fabs(cosTheta(w_half))*dot(win,w_half);
+
+    return local_to_global(normal, wout);
+}
+
 float3 get_direction(float3 normal, float3 in, Material mat, float* bxdf, uint2* rand_state, int* transmitted, Material current){
     float3 win = -global_to_local(normal, in);
+#if HAS_REFRACTION
     float ref_type = (float)(rand(rand_state))/(float)RAND_MAX;
     float etaI;
     float etaT;
@@ -108,34 +179,18 @@ float3 get_direction(float3 normal, float3 in, Material mat, float* bxdf, uint2*
         float3 refracted = ratio*(-win + dt*nl) - sqrt(disc)*nl;
         return local_to_global(normal, refracted);
     }
+#endif
     float phi = 2*M_PI*((float)rand(rand_state)/(float)RAND_MAX);
     float xi = (float)(rand(rand_state))/(float)RAND_MAX;
-    if(mat.type == LAMBERTIAN){
-        float costheta = acos(xi)*2/M_PI;
-        float sintheta = sqrt(1-costheta*costheta);
-        *bxdf = costheta*costheta/M_PI*2/sqrt(1-xi*xi);
-        return local_to_global(normal, (float3)(sintheta*cos(phi), sintheta*sin(phi), costheta));
-    }
-    else{ // importance sampling based on pbrt
-        float tan2theta = -mat.alpha*mat.alpha*log(xi);
-        float costheta = 1/sqrt(1+tan2theta);
-        float sintheta = sqrt(1-costheta*costheta);
-
-        float3 w_half = (float3)(sintheta*cos(phi), sintheta*sin(phi), costheta);
-        if (win.z*w_half.z < 0) w_half = -w_half;
-
-        float3 wout = -win + 2*w_half*dot(win,w_half);
-
-        float cout = cosTheta(wout);
-        float cin = cosTheta(win);
-        if( cout*cin < 0){
-            *bxdf = 0;
-        }
-        else
-            *bxdf = G(win, wout, mat)/cin/fabs(cosTheta(w_half))*dot(win,w_half);
-
-        return local_to_global(normal, wout);
-    }
+#if HAS_LAMBERTIAN && HAS_COOK_TORRANCE
+    if(mat.type == LAMBERTIAN)
+        return sample_lambertian(normal, phi, xi, bxdf);
+    return sample_cook_torrance(normal, win, mat, phi, xi, bxdf);
+#elif HAS_LAMBERTIAN
+    return sample_lambertian(normal, phi, xi, bxdf);
+#else
+    return sample_cook_torrance(normal, win, mat, phi, xi, bxdf);
+#endif
 }
 
 // return min and max components of a vector
@@ -229,23 +284,85 @@ bool intersect_scene(global GPU_BVHnode* bvh, global Triangle* triangles, Ray ra
     return t < 1e19;
 }
 
-float3 trace(global GPU_BVHnode* bvh, global Triangle* triangles, Ray ray, global Material* materials, uint2* rand_state){
+#if HAS_ENVMAP
+// the pixel of the map a direction falls in and the chance of sampling the
+// direction, per unit solid angle
+int env_pixel(int2 env_size, float3 dir, global EnvSample* env_table, float* pdf){
+    float u = atan2(dir.x, -dir.z)/(2*M_PI) + 0.5f;
+    float v = acos(clamp(dir.y, -1.0f, 1.0f))/M_PI;
+    int x = min((int)(u*env_size.x), env_size.x - 1);
+    int y = min((int)(v*env_size.y), env_size.y - 1);
+    int i = y*env_size.x + x;
+    float sin_theta = sqrt(fmax(1 - dir.y*dir.y, 0.0f));
+    *pdf = sin_theta > 0 ? env_table[i].pdf*env_size.x*env_size.y/(2*M_PI*M_PI*sin_theta) : 0;
+    return i;
+}
+
+// a direction towards the map, picked in proportion to the light coming from it
+float3 sample_env(int2 env_size, global EnvSample* env_table, uint2* rand_state, float* pdf, int* pixel){
+    int n = env_size.x*env_size.y;
+    int i = min((int)((float)rand(rand_state)/(float)RAND_MAX*n), n - 1);
+    if ((float)rand(rand_state)/(float)RAND_MAX >= env_table[i].keep)
+        i = env_table[i].alias;
+    float u = (i%env_size.x + (float)rand(rand_state)/(float)RAND_MAX)/env_size.x;
+    float v = (i/env_size.x + (float)rand(rand_state)/(float)RAND_MAX)/env_size.y;
+    float phi = (u - 0.5f)*2*M_PI;
+    float theta = v*M_PI;
+    float sin_theta = sin(theta);
+    *pdf = sin_theta > 0 ? env_table[i].pdf*n/(2*M_PI*M_PI*sin_theta) : 0;
+    *pixel = i;
+    return (float3)(sin_theta*sin(phi), cos(theta), -sin_theta*cos(phi));
+}
+
+// the chance of sample_lambertian picking a direction at cos_theta from the
+// normal, and what it weighs the light from there by
+float lambertian_pdf(float cos_theta){
+    return cos_theta > 0 ? sin(cos_theta*M_PI/2)/4 : 0;
+}
+
+float power_heuristic(float pdf, float other){
+    return pdf*pdf/(pdf*pdf + other*other);
+}
+#endif
+
+float3 trace(global GPU_BVHnode* bvh, global Triangle* triangles, Ray ray, global Material* materials, global float3* env, global EnvSample* env_table, int2 env_size, uint2* rand_state, Features* first, AOVs* aov){
     float3 color = (float3)(0.0,0.0,0.0);
     float3 mask = (float3)(1.0,1.0,1.0);
-    Material stack[10];
+#if HAS_ENVMAP
+    float bounce_pdf = 0; // of the last bounce when it also sampled the map, otherwise 0
+#endif
+#if HAS_AOVS
+    aov->direct = (float3)(0,0,0);
+    aov->material = -1;
+#endif
+#if HAS_REFRACTION
+    Material stack[MAX_BOUNCES+1];
     int stack_idx = 0;
     stack[0].ref_idx = 1;
     stack[0].attenuation = (float3)(0, 0, 0);
-    for (int bounces = 0; bounces < 10; ++bounces){
+#endif
+    for (int bounces = 0; bounces < MAX_BOUNCES; ++bounces){
         HitData dat;
         if(intersect_scene(bvh, triangles, ray, &dat)){
             Material mat = materials[dat.mat];
+#if HAS_FEATURES
+            if (bounces == 0){
+                first->albedo = mat.color;
+                first->normal = dot(dat.normal, ray.direction) < 0 ? dat.normal : -dat.normal;
+                first->depth = dat.t;
+            }
+#endif
+#if HAS_AOVS
+            if (bounces == 0)
+                aov->material = dat.mat;
+#endif
             ray.origin = ray.origin + dat.t*ray.direction;
 
-            float3 atten = stack[stack_idx].attenuation;
-
             float bxdf;
             int transmitted = 0;
+#if HAS_REFRACTION
+            float3 atten = stack[stack_idx].attenuation;
+
             float3 new_direction = get_direction(dat.normal, ray.direction, mat, &bxdf, rand_state, &transmitted, stack[stack_idx]);
 
             if (transmitted){
@@ -261,14 +378,67 @@ float3 trace(global GPU_BVHnode* bvh, global Triangle* triangles, Ray ray, globa
             float g = exp(-atten.y*dat.t);
             float b = exp(-atten.z*dat.t);
             mask = mask*(float3)(r,g,b);
+#else
+            // nothing refracts so rays never travel inside anything
+            float3 new_direction = get_direction(dat.normal, ray.direction, mat, &bxdf, rand_state, &transmitted, mat);
+            if (dot(dat.normal, ray.direction) < 0)
+                ray.origin += 0.000001f*dat.normal;
+#endif
 
             color += mask*mat.emission;
+#if HAS_AOVS
+            if (bounces <= 1)
+                aov->direct = color;
+#endif
+#if HAS_ENVMAP
+            // next event estimation on diffuse surfaces, weighed against the
+            // bounce hitting the same part of the map
+            bounce_pdf = 0;
+            if (mat.type == LAMBERTIAN && mat.ref_idx == 0){
+                float light_pdf;
+                int pixel;
+                float3 dir = sample_env(env_size, env_table, rand_state, &light_pdf, &pixel);
+                float cos_theta = dot(dat.normal, dir);
+                HitData blocked;
+                Ray shadow = {ray.origin, dir};
+                if (cos_theta > 0 && light_pdf > 0 && !intersect_scene(bvh, triangles, shadow, &blocked)){
+                    float weight = cos_theta*cos_theta/(2*M_PI)/light_pdf*power_heuristic(light_pdf, lambertian_pdf(cos_theta));
+                    color += mask*mat.color*env[pixel]*weight;
+                }
+                bounce_pdf = lambertian_pdf(dot(dat.normal, new_direction));
+#if HAS_AOVS
+                if (bounces == 0)
+                    aov->direct = color;
+#endif
+            }
+#endif
             mask = mask*mat.color*bxdf;
             ray.direction = new_direction;
         }
         else{
+#if HAS_ENVMAP
+            float light_pdf;
+            float3 sky = env[env_pixel(env_size, ray.direction, env_table, &light_pdf)];
+#else
             float t = (ray.direction.y + 1)/2;
-            return color + mask*((float3)(1,1,1)*(1-t) + (float3)(0.5,0.7,1)*t);
+            float3 sky = (float3)(1,1,1)*(1-t) + (float3)(0.5,0.7,1)*t;
+#endif
+#if HAS_FEATURES
+            if (bounces == 0){
+                first->albedo = sky;
+                first->normal = (float3)(0,0,0);
+                first->depth = 0;
+            }
+#endif
+#if HAS_ENVMAP
+            if (bounce_pdf > 0)
+                sky *= power_heuristic(bounce_pdf, light_pdf);
+#endif
+#if HAS_AOVS
+            if (bounces <= 1)
+                aov->direct = color + mask*sky;
+#endif
+            return color + mask*sky;
         }
         if (mask.x + mask.y + mask.z < 0.01) break;
     }
@@ -276,45 +446,158 @@ float3 trace(global GPU_BVHnode* bvh, global Triangle* triangles, Ray ray, globa
     return color;
 }
 
-void kernel render(global float3* image, global uint2* seeds, global GPU_BVHnode* bvh, global Triangle* triangles, global Material* materials, Camera camera, int samples){
-    int x = get_global_id(0);
-    int y = get_global_id(1);
-    int width = get_global_size(0);
-    int height = get_global_size(1);
-    uint2 rand_state = seeds[(height-y-1)*width+x];
-    rand(&rand_state);
+Ray camera_ray(RayGen camera, int x, int y, int width, int height, uint2* rand_state){
+    Ray ray;
+    if (camera.type == PANORAMIC){ // equirectangular, x covers all longitudes and y all latitudes
+        float xs = (float)rand(rand_state)/(float)RAND_MAX;
+        float ys = (float)rand(rand_state)/(float)RAND_MAX;
+        float phi = (2*(float)(x+xs)/(float)width - 1)*M_PI;
+        float theta = ((float)(y+ys)/(float)height - 0.5f)*M_PI;
+        ray.origin = camera.origin;
+        ray.direction = cos(theta)*sin(phi)*camera.u + sin(theta)*camera.v - cos(theta)*cos(phi)*camera.w;
+        return ray;
+    }
+
+    ray.origin = camera.origin;
+#if HAS_LENS
+    if (camera.type == PERSPECTIVE){ // thin lens
+        float theta = 2*M_PI*(float)rand(rand_state)/(float)RAND_MAX;
+        float rad = camera.lens_radius*(float)rand(rand_state)/(float)RAND_MAX;
+        ray.origin += rad*(camera.u*cos(theta) + camera.v*sin(theta));
+    }
+#endif
 
-    //camera space unit basis vectors
-    float3 w = normalize(camera.location - camera.looking_at);
-    float3 u = cross((float3)(0,1,0), w);
-    float3 v = cross(w,u);
+    float xs = (float)rand(rand_state)/(float)RAND_MAX;
+    float ys = (float)rand(rand_state)/(float)RAND_MAX;
+    float3 target = camera.screen_corner + camera.horiz*(float)(x+xs)/(float)width + camera.vert*(float)(y+ys)/(float)height;
 
-    float focal_length = length(camera.location - camera.looking_at);
-    float screen_height = native_tan(camera.aperture/2);
-    float screen_width = screen_height*width/height;
+    if (camera.type == ORTHOGRAPHIC){
+        ray.origin = target;
+        ray.direction = -camera.w;
+    }
+    else
+        ray.direction = normalize(target - ray.origin);
+    return ray;
+}
+
+float luminance(float3 c){
+    return dot(c, (float3)(0.2126f, 0.7152f, 0.0722f));
+}
 
-    float3 screen_corner = camera.location - screen_width*focal_length*u - screen_height*focal_length*v - focal_length*w;
-    float3 horiz = 2*screen_width*focal_length*u;
-    float3 vert = 2*screen_height*focal_length*v;
+// tile is x, y, width, height of the part of the image being rendered, in rows from the top.
+// all of the per-pixel buffers only cover the tile.
+// features and aovs are only written with HAS_FEATURES and HAS_AOVS, and the
+// environment map is only read with HAS_ENVMAP. buffers still have to be passed
+void kernel render(global float3* image, global float* sq_image, global uint* counts, global uchar* active, global Features* features, global AOVs* aovs, global GPU_BVHnode* bvh, global Triangle* triangles, global Material* materials, global float3* env, global EnvSample* env_table, int2 env_size, RayGen camera, int samples, int4 tile, int2 image_size){
+    int tx = get_global_id(0);
+    int ty = get_global_id(1);
+    if (tx >= tile.z || ty >= tile.w) return;
+    int idx = ty*tile.z + tx;
+    int width = image_size.x;
+    int height = image_size.y;
+    int x = tile.x + tx;
+    int y = height - (tile.y + ty) - 1;
+    if (!active[idx]) return;
+    uint pixel = (tile.y + ty)*width + x;
+    uint first_sample = counts[idx];
 
     float3 color = (float3)(0,0,0);
+    float sq = 0;
+    Features sum = {(float3)(0,0,0), (float3)(0,0,0), 0};
+    float3 direct = (float3)(0,0,0);
     for (int sample = 0; sample < samples; ++sample){
-        Ray ray;
+        uint2 rand_state = rand_init(pixel, first_sample + sample);
+        Ray ray = camera_ray(camera, x, y, width, height, &rand_state);
+        Features first;
+        AOVs aov;
+        float3 c = trace(bvh, triangles, ray, materials, env, env_table, env_size, &rand_state, &first, &aov);
+        float l = luminance(c);
+        color += c;
+        sq += l*l;
+#if HAS_FEATURES
+        sum.albedo += first.albedo;
+        sum.normal += first.normal;
+        sum.depth += first.depth;
+#endif
+#if HAS_AOVS
+        direct += aov.direct;
+        if (first_sample + sample == 0)
+            aovs[idx].material = aov.material;
+#endif
+    }
+
+    image[idx] += color;
+    sq_image[idx] += sq;
+    counts[idx] += samples;
+#if HAS_FEATURES
+    features[idx].albedo += sum.albedo;
+    features[idx].normal += sum.normal;
+    features[idx].depth += sum.depth;
+#endif
+#if HAS_AOVS
+    aovs[idx].direct += direct;
+#endif
 
-        float theta = 2*M_PI*(float)rand(&rand_state)/(float)RAND_MAX;
-        float rad = camera.lens_radius*(float)rand(&rand_state)/(float)RAND_MAX;
-        ray.origin = camera.location + rad*(u*cos(theta) + v*sin(theta));
+}
 
-        float xs = (float)rand(&rand_state)/(float)RAND_MAX;
-        float ys = (float)rand(&rand_state)/(float)RAND_MAX;
+// a pixel needs this many samples before its variance estimate is trusted,
+// below it one lucky path can look converged
+#define MIN_SAMPLES 16
 
-        ray.direction = normalize(screen_corner + horiz*(float)(x+xs)/(float)width + vert*(float)(y+ys)/(float)height - ray.origin);
+// turn off pixels whose estimated relative error is below target, counting the rest
+void kernel update_mask(global float3* image, global float* sq_image, global uint* counts, global uchar* active, global int* active_count, float target, uint max_samples){
+    int i = get_global_id(0);
+    if (!active[i]) return;
 
+    float n = counts[i];
+    float mean = luminance(image[i])/n;
+    float variance = fmax(sq_image[i]/n - mean*mean, 0.0f);
+    float error = sqrt(variance/n)/(mean + 0.01f); // offset keeps black pixels from sampling forever
 
-        color += trace(bvh, triangles, ray, materials, &rand_state);
-    }
+    if ((error < target && counts[i] >= MIN_SAMPLES) || counts[i] >= max_samples)
+        active[i] = 0;
+    else
+        atomic_inc(active_count);
+}
+
+// post processing for an image that never leaves the device, the same steps
+// save_image takes on the host. only the packed pixels are read back
 
-    image[(height-y-1)*width+x] += color;
-    seeds[(height-y-1)*width+x] = rand_state;
+// what copy_tile would have made of a pixel, the mean of its samples
+float3 pixel_mean(global float3* image, global uint* counts, int i){
+    return counts[i] ? image[i]*(1.0f/counts[i]) : (float3)(0,0,0);
+}
 
+// the horizontal pass of the bloom over what is brighter than white
+void kernel bloom_rows(global float3* image, global uint* counts, global float3* blurred, global float* taps, int radius, int2 size){
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    if (x >= size.x || y >= size.y) return;
+    float3 sum = (float3)(0,0,0);
+    for (int k = max(-radius, -x); k <= min(radius, size.x - 1 - x); ++k)
+        sum += taps[k + radius]*fmax(pixel_mean(image, counts, y*size.x + x + k) - 1, 0.0f);
+    blurred[y*size.x + x] = sum;
+}
+
+// lut holds the smallest value that comes out as each level from 1 to 255,
+// so a binary search gives exactly what the host's curve does
+uchar tonemap(float x, global float* lut){
+    int level = 0;
+    for (int step = 128; step; step >>= 1)
+        if (x >= lut[level + step - 1])
+            level += step;
+    return level;
+}
+
+// the vertical pass of the bloom, added to the image then tonemapped and packed
+void kernel finish_image(global float3* image, global uint* counts, global float3* blurred, global float* taps, int radius, global float* lut, global uchar4* rgba, int2 size){
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    if (x >= size.x || y >= size.y) return;
+    float3 sum = (float3)(0,0,0);
+    for (int k = max(-radius, -y); k <= min(radius, size.y - 1 - y); ++k)
+        sum += taps[k + radius]*blurred[(y + k)*size.x + x];
+    int i = y*size.x + x;
+    float3 c = (1.0f/20)*sum + pixel_mean(image, counts, i);
+    rgba[i] = (uchar4)(tonemap(c.x, lut), tonemap(c.y, lut), tonemap(c.z, lut), 255);
 }